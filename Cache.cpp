@@ -0,0 +1,221 @@
+#include "Cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace {
+const char ENTRY_SUFFIX[] = ".entry";
+const char TEMP_PREFIX[] = ".tmp-";
+// Temporaries this old were left by a run that died while storing
+const time_t STALE_TEMP = 24 * 60 * 60;
+// The trailer's length, as a fixed-width decimal and a newline, ends the file
+const size_t FOOTER_LEN = 21;
+
+// FNV-1a; entry names must be stable across builds, which std::hash isn't
+uint64_t fnv1a(const std::string &text) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(unsigned char ch : text) {
+    hash ^= ch;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Lets the kernel share extents where the filesystem can, and copies otherwise
+bool copy_range(int in, int out, uint64_t off, uint64_t len) {
+  loff_t in_off = off, out_off = off;
+  while(len != 0) {
+    ssize_t copied = copy_file_range(in, &in_off, out, &out_off, len, 0);
+    if(copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if(copied <= 0) {
+      break;
+    }
+    len -= copied;
+  }
+
+  char buffer[64 * 1024];
+  while(len != 0) {
+    ssize_t n = pread(in, buffer, std::min<uint64_t>(len, sizeof(buffer)), in_off);
+    if(n <= 0 || pwrite(out, buffer, n, out_off) != n) {
+      return false;
+    }
+    in_off += n;
+    out_off += n;
+    len -= n;
+  }
+  return true;
+}
+}
+
+std::string PieceCache::path(const std::string &key) const {
+  char name[17];
+  snprintf(name, sizeof(name), "%016" PRIx64, fnv1a(key));
+  return dir_ + "/" + name + ENTRY_SUFFIX;
+}
+
+// An entry is one file, so replacing it is a single rename: the file's
+// bytes at their own offsets, sparse where absent, followed by a trailer
+// listing the ranges held and then the trailer's length:
+//
+//   <size bytes of data>anchor-cache 2 <size>\n<off> <end>\n...<length>\n
+IntervalSet PieceCache::fetch(const std::string &key, uint64_t size, int out_fd, uint8_t *out_buffer) {
+  IntervalSet supplied;
+  const std::string name = path(key);
+  int data = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+  if(data == -1) {
+    return supplied;
+  }
+
+  struct stat st;
+  char footer[FOOTER_LEN + 1] = {};
+  uint64_t trailer_len = 0;
+  std::string trailer;
+  bool ok = fstat(data, &st) == 0 && static_cast<uint64_t>(st.st_size) >= size + FOOTER_LEN &&
+    pread(data, footer, FOOTER_LEN, st.st_size - FOOTER_LEN) == static_cast<ssize_t>(FOOTER_LEN) &&
+    1 == sscanf(footer, "%" SCNu64, &trailer_len) && size + trailer_len + FOOTER_LEN == static_cast<uint64_t>(st.st_size);
+  if(ok) {
+    trailer.resize(trailer_len);
+    ok = pread(data, &trailer[0], trailer_len, size) == static_cast<ssize_t>(trailer_len);
+  }
+
+  uint64_t entry_size = 0;
+  int consumed = 0;
+  const char *cursor = trailer.c_str();
+  if(ok && 1 == sscanf(cursor, "anchor-cache 2 %" SCNu64 "\n%n", &entry_size, &consumed) && consumed != 0 &&
+     entry_size == size) {
+    cursor += consumed;
+    uint64_t off, end;
+    while(2 == sscanf(cursor, "%" SCNu64 " %" SCNu64 "\n%n", &off, &end, &consumed) && consumed != 0) {
+      cursor += consumed;
+      if(off >= end || end > size) {
+        break;
+      }
+      bool copied;
+      if(out_buffer != nullptr) {
+        copied = pread(data, out_buffer + off, end - off, off) == static_cast<ssize_t>(end - off);
+      } else {
+        copied = copy_range(data, out_fd, off, end - off);
+      }
+      if(!copied) {
+        fprintf(stderr, "WARN: Couldn't copy from cache entry %s: %s\n", name.c_str(), strerror(errno));
+        break;
+      }
+      supplied.insert(Chunk{off, end - off});
+    }
+    // Marks the entry as recently used
+    futimens(data, nullptr);
+  }
+
+  ::close(data);
+  return supplied;
+}
+
+void PieceCache::store(const std::string &key, uint64_t size, const IntervalSet &ranges, int out_fd,
+                       const uint8_t *out_buffer) {
+  if(mkdir(dir_.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    fprintf(stderr, "WARN: Couldn't create cache directory %s: %s\n", dir_.c_str(), strerror(errno));
+    return;
+  }
+
+  // Written under a name of its own and renamed into place, so neither
+  // readers nor other runs storing the same entry ever see it torn
+  const std::string name = path(key);
+  std::string temp = dir_ + "/" + TEMP_PREFIX + name.substr(dir_.size() + 1) + "-XXXXXX";
+  int data = mkostemp(&temp[0], O_CLOEXEC);
+  if(data == -1) {
+    fprintf(stderr, "WARN: Couldn't write cache entry %s: %s\n", name.c_str(), strerror(errno));
+    return;
+  }
+
+  std::string trailer = "anchor-cache 2 " + std::to_string(size) + "\n";
+  bool ok = ftruncate(data, size) == 0;
+  for(auto it = ranges.begin(); ok && it != ranges.end(); ++it) {
+    uint64_t off = it->first, len = it->second - it->first;
+    if(out_buffer != nullptr) {
+      ok = pwrite(data, out_buffer + off, len, off) == static_cast<ssize_t>(len);
+    } else {
+      ok = copy_range(out_fd, data, off, len);
+    }
+    trailer += std::to_string(off) + " " + std::to_string(off + len) + "\n";
+  }
+  char footer[FOOTER_LEN + 1];
+  snprintf(footer, sizeof(footer), "%020zu\n", trailer.size());
+  trailer += footer;
+  ok = ok && pwrite(data, trailer.data(), trailer.size(), size) == static_cast<ssize_t>(trailer.size());
+  if(::close(data) != 0) {
+    ok = false;
+  }
+  if(!ok || rename(temp.c_str(), name.c_str()) != 0) {
+    fprintf(stderr, "WARN: Couldn't write cache entry %s: %s\n", name.c_str(), strerror(errno));
+    unlink(temp.c_str());
+    return;
+  }
+
+  evict(name);
+}
+
+void PieceCache::remove(const std::string &key) {
+  unlink(path(key).c_str());
+}
+
+void PieceCache::evict(const std::string &keep) {
+  struct Entry {
+    std::string name;
+    uint64_t bytes;
+    struct timespec used;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+
+  DIR *dir = opendir(dir_.c_str());
+  if(dir == nullptr) {
+    return;
+  }
+  const size_t suffix_len = sizeof(ENTRY_SUFFIX) - 1, prefix_len = sizeof(TEMP_PREFIX) - 1;
+  const time_t now = time(nullptr);
+  while(struct dirent *ent = readdir(dir)) {
+    std::string name = ent->d_name;
+    std::string full = dir_ + "/" + name;
+    struct stat st;
+    if(name.compare(0, prefix_len, TEMP_PREFIX) == 0) {
+      if(stat(full.c_str(), &st) == 0 && now - st.st_mtime > STALE_TEMP) {
+        unlink(full.c_str());
+      }
+      continue;
+    }
+    if(name.size() <= suffix_len || name.compare(name.size() - suffix_len, suffix_len, ENTRY_SUFFIX) != 0 ||
+       stat(full.c_str(), &st) != 0) {
+      continue;
+    }
+    // Entries are sparse, so count what they occupy rather than their length
+    uint64_t bytes = static_cast<uint64_t>(st.st_blocks) * 512;
+    total += bytes;
+    entries.push_back(Entry{full, bytes, st.st_mtim});
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+      return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+  for(const auto &entry : entries) {
+    if(total <= limit_) {
+      break;
+    }
+    if(entry.name == keep) {
+      continue;
+    }
+    unlink(entry.name.c_str());
+    total -= entry.bytes;
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef ANCHOR_CACHE_H_
+#define ANCHOR_CACHE_H_
+
+#include <string>
+#include <cinttypes>
+
+#include "IntervalSet.h"
+
+// Pieces of earlier downloads kept on disk across runs. An entry is a
+// single file: a sparse copy of the download followed by the list of
+// ranges it holds, named after a hash of the URL and validator (ETag or
+// Last-Modified) it was fetched with. Entries are evicted least recently used first once the directory
+// outgrows its limit.
+class PieceCache {
+public:
+  PieceCache(std::string dir, uint64_t limit) : dir_(std::move(dir)), limit_(limit) {}
+
+  // Copies whatever the entry holds into the output, which is out_buffer if
+  // it's non-null and out_fd otherwise, and returns the ranges supplied
+  IntervalSet fetch(const std::string &key, uint64_t size, int out_fd, uint8_t *out_buffer);
+  // Replaces the entry with ranges of the output, then evicts
+  void store(const std::string &key, uint64_t size, const IntervalSet &ranges, int out_fd, const uint8_t *out_buffer);
+  // Deletes the entry, e.g. once a file built partly from it fails its checksum
+  void remove(const std::string &key);
+
+private:
+  std::string path(const std::string &key) const;
+  void evict(const std::string &keep);
+
+  const std::string dir_;
+  const uint64_t limit_;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "Checksum.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include <unistd.h>
+
+#include "Client.h"
+
+const uint64_t Checksum::LEAF_SIZE;
+
+namespace {
+// Smallest job worth a trip through the threadpool, until the download ends
+const uint64_t BATCH = 16 * 1024 * 1024;
+// Below this many leaves per thread, another thread costs more than it saves
+const size_t MIN_THREAD_LEAVES = 16;
+const size_t READ_SIZE = 1024 * 1024;
+// Tree hashes are domain-separated as in RFC 6962, so no leaf can pass for
+// an interior node, and the root is bound to the file's length
+const uint8_t LEAF_PREFIX = 0, NODE_PREFIX = 1, ROOT_PREFIX = 2;
+
+void work_cb(uv_work_t *req) {
+  auto &job = *reinterpret_cast<Checksum::Job *>(req);
+  job.checksum.work(job);
+}
+
+void after_work_cb(uv_work_t *req, int status) {
+  (void)status;
+  auto &job = *reinterpret_cast<Checksum::Job *>(req);
+  job.checksum.done(job);
+}
+
+// Feeds a range of the output to ctx; returns 0, or an errno value
+int feed(EVP_MD_CTX *ctx, const uint8_t *data, int fd, uint64_t off, uint64_t len, std::vector<uint8_t> &buffer) {
+  if(data != nullptr) {
+    EVP_DigestUpdate(ctx, data + off, len);
+    return 0;
+  }
+  // Not the output mapping: it's write-only
+  buffer.resize(READ_SIZE);
+  while(len != 0) {
+    ssize_t n = pread(fd, buffer.data(), std::min<uint64_t>(len, buffer.size()), off);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      return n == 0 ? EIO : errno;
+    }
+    EVP_DigestUpdate(ctx, buffer.data(), n);
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int hex_value(char ch) {
+  if(ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  ch |= 0x20;
+  return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+std::string to_hex(const std::vector<uint8_t> &bytes) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for(auto byte : bytes) {
+    hex += digits[byte >> 4];
+    hex += digits[byte & 15];
+  }
+  return hex;
+}
+}
+
+Checksum::~Checksum() {
+  EVP_MD_CTX_free(ctx_);
+}
+
+const char *Checksum::start(const char *spec) {
+  // Digest names never contain a colon
+  const char *colon = strrchr(spec, ':');
+  if(colon == nullptr) {
+    return "checksum must be given as algo:hex";
+  }
+  std::string name(spec, colon);
+  if(name.compare(0, 5, "tree-") == 0) {
+    tree_ = true;
+    name.erase(0, 5);
+  }
+  md_ = EVP_get_digestbyname(name.c_str());
+  if(md_ == nullptr) {
+    return "unknown checksum algorithm";
+  }
+  md_size_ = EVP_MD_size(md_);
+
+  const char *hex = colon + 1;
+  if(strlen(hex) != 2 * md_size_) {
+    return "checksum has the wrong length for its algorithm";
+  }
+  expected_.resize(md_size_);
+  for(size_t i = 0; i < md_size_; ++i) {
+    int high = hex_value(hex[2 * i]), low = hex_value(hex[2 * i + 1]);
+    if(high < 0 || low < 0) {
+      return "checksum isn't hexadecimal";
+    }
+    expected_[i] = high << 4 | low;
+  }
+
+  if(!tree_) {
+    ctx_ = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx_, md_, nullptr);
+  }
+  active_ = true;
+  return nullptr;
+}
+
+void Checksum::advance() {
+  if(!active_ || job_ != nullptr || !error_.empty() || (final_ && !client.error.empty())) {
+    return;
+  }
+
+  Chunk range{0, 0};
+  std::vector<size_t> leaves;
+  if(!tree_) {
+    Chunk prefix = client.completed.find(0);
+    uint64_t ready = prefix.len - hashed_;
+    if(ready == 0 || (ready < BATCH && !final_)) {
+      return;
+    }
+    range = Chunk{hashed_, ready};
+  } else {
+    // Rescanning is proportional to the leaves found plus the ranges
+    // skipped, so wait until a batch's worth has arrived
+    uint64_t size = client.completed.size();
+    if(size - scanned_ < BATCH && !final_) {
+      return;
+    }
+    scanned_ = size;
+    for(const auto &done : client.completed) {
+      // The short last leaf only once the size is final
+      bool tail = final_ && done.second == client.file_size;
+      for(uint64_t pos = (done.first + LEAF_SIZE - 1) / LEAF_SIZE * LEAF_SIZE; pos < done.second;) {
+        Chunk hashed = queued_.find(pos);
+        if(hashed.len != 0) {
+          pos = hashed.off + hashed.len;
+          continue;
+        }
+        if(pos + LEAF_SIZE > done.second && !tail) {
+          break;
+        }
+        leaves.push_back(pos / LEAF_SIZE);
+        pos += LEAF_SIZE;
+      }
+    }
+    if(leaves.empty()) {
+      return;
+    }
+    for(auto leaf : leaves) {
+      queued_.insert(Chunk{leaf * LEAF_SIZE, std::min(LEAF_SIZE, client.file_size - leaf * LEAF_SIZE)});
+    }
+  }
+
+  // Deleted by done()
+  job_ = new Job{{}, *this, client.output_buffer, client.fd, client.file_size, range, std::move(leaves), {}, 0};
+  uv_queue_work(client.loop, &job_->req, work_cb, after_work_cb);
+}
+
+void Checksum::finish() {
+  final_ = true;
+  advance();
+}
+
+void Checksum::work(Job &job) {
+  std::vector<uint8_t> buffer;
+  if(!tree_) {
+    job.error = feed(ctx_, job.data, job.fd, job.range.off, job.range.len, buffer);
+    return;
+  }
+
+  size_t count = job.leaves.size();
+  job.digests.resize(count * md_size_);
+  size_t max_threads = count / MIN_THREAD_LEAVES + 1;
+  size_t threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), max_threads));
+  size_t slice = (count + threads - 1) / threads;
+  std::vector<int> errors(threads);
+  auto hash = [&](size_t t) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    std::vector<uint8_t> leaf_buffer;
+    for(size_t i = t * slice; i < std::min(count, (t + 1) * slice) && errors[t] == 0; ++i) {
+      uint64_t off = job.leaves[i] * LEAF_SIZE;
+      EVP_DigestInit_ex(ctx, md_, nullptr);
+      EVP_DigestUpdate(ctx, &LEAF_PREFIX, 1);
+      errors[t] = feed(ctx, job.data, job.fd, off, std::min(LEAF_SIZE, job.file_size - off), leaf_buffer);
+      EVP_DigestFinal_ex(ctx, &job.digests[i * md_size_], nullptr);
+    }
+    EVP_MD_CTX_free(ctx);
+  };
+
+  std::vector<std::thread> workers;
+  for(size_t t = 1; t < threads; ++t) {
+    workers.emplace_back(hash, t);
+  }
+  hash(0);
+  for(auto &worker : workers) {
+    worker.join();
+  }
+  for(auto error : errors) {
+    if(error != 0) {
+      job.error = error;
+      break;
+    }
+  }
+}
+
+void Checksum::done(Job &job) {
+  job_ = nullptr;
+  if(job.error != 0) {
+    error_ = std::string("Couldn't read the output back for its checksum: ") + strerror(job.error);
+  } else if(tree_) {
+    for(size_t i = 0; i < job.leaves.size(); ++i) {
+      size_t end = (job.leaves[i] + 1) * md_size_;
+      if(leaf_digests_.size() < end) {
+        leaf_digests_.resize(end);
+      }
+      memcpy(&leaf_digests_[end - md_size_], &job.digests[i * md_size_], md_size_);
+    }
+  } else {
+    hashed_ += job.range.len;
+  }
+  delete &job;
+
+  advance();
+  if(!busy() && client.finished) {
+    client.maybe_done();
+  }
+}
+
+std::string Checksum::verify() {
+  if(!active_) {
+    return "";
+  }
+  if(!error_.empty()) {
+    return error_;
+  }
+
+  std::vector<uint8_t> actual;
+  if(tree_) {
+    if(queued_.size() != client.file_size) {
+      return "checksum didn't cover the whole file";
+    }
+    actual = root();
+  } else {
+    if(hashed_ != client.file_size) {
+      return "checksum didn't cover the whole file";
+    }
+    actual.resize(md_size_);
+    EVP_DigestFinal_ex(ctx_, actual.data(), nullptr);
+  }
+  if(actual != expected_) {
+    return "checksum mismatch: expected " + to_hex(expected_) + ", got " + to_hex(actual);
+  }
+  return "";
+}
+
+std::vector<uint8_t> Checksum::root() const {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  size_t count = (client.file_size + LEAF_SIZE - 1) / LEAF_SIZE;
+  std::vector<uint8_t> level(leaf_digests_.begin(), leaf_digests_.begin() + count * md_size_);
+  if(count == 0) {
+    // An empty file is one empty leaf
+    count = 1;
+    level.resize(md_size_);
+    EVP_DigestInit_ex(ctx, md_, nullptr);
+    EVP_DigestUpdate(ctx, &LEAF_PREFIX, 1);
+    EVP_DigestFinal_ex(ctx, level.data(), nullptr);
+  }
+  while(count > 1) {
+    std::vector<uint8_t> next((count + 1) / 2 * md_size_);
+    for(size_t i = 0; i < count / 2; ++i) {
+      EVP_DigestInit_ex(ctx, md_, nullptr);
+      EVP_DigestUpdate(ctx, &NODE_PREFIX, 1);
+      EVP_DigestUpdate(ctx, &level[2 * i * md_size_], 2 * md_size_);
+      EVP_DigestFinal_ex(ctx, &next[i * md_size_], nullptr);
+    }
+    if(count % 2 != 0) {
+      memcpy(&next[count / 2 * md_size_], &level[(count - 1) * md_size_], md_size_);
+    }
+    level.swap(next);
+    count = (count + 1) / 2;
+  }
+
+  uint8_t length[8];
+  for(int i = 0; i < 8; ++i) {
+    length[i] = static_cast<uint8_t>(client.file_size >> (56 - 8 * i));
+  }
+  std::vector<uint8_t> result(md_size_);
+  EVP_DigestInit_ex(ctx, md_, nullptr);
+  EVP_DigestUpdate(ctx, &ROOT_PREFIX, 1);
+  EVP_DigestUpdate(ctx, level.data(), md_size_);
+  EVP_DigestUpdate(ctx, length, sizeof(length));
+  EVP_DigestFinal_ex(ctx, result.data(), nullptr);
+  EVP_MD_CTX_free(ctx);
+  return result;
+}
@@ -0,0 +1,91 @@
+#ifndef ANCHOR_CHECKSUM_H_
+#define ANCHOR_CHECKSUM_H_
+
+#include <string>
+#include <vector>
+#include <cinttypes>
+
+#include <uv.h>
+#include <openssl/evp.h>
+
+#include "IntervalSet.h"
+
+struct Client;
+
+// Whole-file digest computed while the download runs, so checking it
+// doesn't take a second pass over the file. Jobs run on libuv's threadpool,
+// one at a time, over bytes written moments ago and still in page cache.
+//
+// "algo:hex" hashes the file front to back with any OpenSSL digest, so it
+// follows the completed prefix. "tree-algo:hex" hashes LEAF_SIZE leaves
+// wherever they complete, spreading each job across every core. With H the
+// digest and || concatenation, the tree is built as:
+//
+//   leaf  = H(0x00 || up to LEAF_SIZE bytes)     an empty file is one empty leaf
+//   node  = H(0x01 || left || right)             level by level; an odd node
+//                                                out moves up unchanged
+//   final = H(0x02 || root || file size as 8 bytes, big-endian)
+//
+// README.md has a script that computes it for a local file.
+class Checksum {
+public:
+  static const uint64_t LEAF_SIZE = 1024 * 1024;
+
+  explicit Checksum(Client &c) : client(c) {}
+  ~Checksum();
+
+  // Returns nullptr on success, or a description of the failure
+  const char *start(const char *spec);
+  // Queues a job for what has completed since the last one, if enough has
+  // and none is running
+  void advance();
+  // The download has ended; a successful one has the rest hashed
+  void finish();
+  bool active() const { return active_; }
+  bool busy() const { return job_ != nullptr; }
+  // Empty if the file matches, once nothing is busy
+  std::string verify();
+
+  struct Job {
+    uv_work_t req;
+    Checksum &checksum;
+    // Read from the caller's buffer if there is one, otherwise from fd
+    const uint8_t *data;
+    int fd;
+    uint64_t file_size;
+    // Linear: the range to feed the running digest
+    Chunk range;
+    // Tree: leaves to hash, and their digests in the same order
+    std::vector<size_t> leaves;
+    std::vector<uint8_t> digests;
+    int error;
+  };
+  void work(Job &job);
+  void done(Job &job);
+
+  Client &client;
+
+private:
+  std::vector<uint8_t> root() const;
+
+  bool active_ = false;
+  bool tree_ = false;
+  bool final_ = false;
+  const EVP_MD *md_ = nullptr;
+  size_t md_size_ = 0;
+  std::vector<uint8_t> expected_;
+  std::string error_;
+  Job *job_ = nullptr;
+
+  // Linear: the running digest, fed by one job at a time, and how far it has got
+  EVP_MD_CTX *ctx_ = nullptr;
+  uint64_t hashed_ = 0;
+
+  // Tree: leaf-aligned ranges queued so far, digests by leaf, and the
+  // completed byte count at the last scan
+  IntervalSet queued_;
+  std::vector<uint8_t> leaf_digests_;
+  uint64_t scanned_ = 0;
+};
+
+#endif
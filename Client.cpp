@@ -1,8 +1,10 @@
 #include "Client.h"
 
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
-#include <cmath>
+#include <algorithm>
+#include <new>
 
 #include <unistd.h>
 #include <sys/mman.h>
@@ -11,23 +13,87 @@
 
 #include <arpa/nameser.h>
 
+#include "Cache.h"
+#include "Delta.h"
+#include "Url.h"
 #include "Util.h"
 
 namespace {
 void ares_process_cb(uv_poll_t *handle, int status, int events) {
   auto &ares_poll = *reinterpret_cast<Client::AresPoll *>(handle);
+  auto &client = ares_poll.client;
   if(status < 0) {
-    // FIXME
-    fprintf(stderr, "FATAL: %s\n", uv_strerror(status));
-    abort();
+    client.finish(std::string("DNS socket: ") + uv_strerror(status));
+    return;
   }
-  ares_process_fd(ares_poll.channel,
+  ares_process_fd(client.dns.channel,
                   events & UV_READABLE ? ares_poll.fd : ARES_SOCKET_BAD,
                   events & UV_WRITABLE ? ares_poll.fd : ARES_SOCKET_BAD);
-  auto &client = *reinterpret_cast<Client *>(handle->data);
   client.ares_stage();
 }
 
+void ares_close_cb(uv_handle_t *handle) {
+  auto poll = reinterpret_cast<Client::AresPoll *>(handle);
+  auto &client = poll->client;
+  delete poll;
+  client.handle_closed();
+}
+
+void client_close_cb(uv_handle_t *handle) {
+  reinterpret_cast<Client *>(handle->data)->handle_closed();
+}
+
+void cancel_cb(uv_async_t *handle) {
+  reinterpret_cast<Client *>(handle->data)->finish("cancelled");
+}
+
+void cache_work_cb(uv_work_t *req) {
+  static_cast<Client *>(req->data)->store_in_cache();
+}
+
+void cache_done_cb(uv_work_t *req, int status) {
+  (void)status;
+  auto &client = *static_cast<Client *>(req->data);
+  client.cache_busy = false;
+  client.maybe_done();
+}
+
+void autotune_cb(uv_timer_t *timer) {
+  reinterpret_cast<Client *>(timer->data)->autotune();
+}
+
+void loop_check_cb(uv_check_t *check) {
+  auto &client = *reinterpret_cast<Client *>(check->data);
+  uint64_t now = uv_hrtime();
+  if(client.last_check != 0) {
+    client.metrics.loop_us.record((now - client.last_check) / 1000);
+  }
+  client.last_check = now;
+}
+
+void scale_timer_cb(uv_timer_t *timer) {
+  reinterpret_cast<Client *>(timer->data)->autoscale();
+}
+
+void rate_timer_cb(uv_timer_t *timer) {
+  auto &client = *reinterpret_cast<Client *>(timer->data);
+  auto now = uv_now(client.loop);
+  // A quarter second's worth of burst smooths over timer jitter
+  int64_t burst = std::max<uint64_t>(client.rate_limit / 4, 16 * 1024);
+  client.rate_tokens = std::min<int64_t>(client.rate_tokens + client.rate_limit * (now - client.last_refill) / 1000, burst);
+  client.last_refill = now;
+  client.update_reading();
+}
+
+void mirror_timer_cb(uv_timer_t *timer) {
+  auto &client = *reinterpret_cast<Client *>(timer->data);
+  // Nothing can be scheduled before some mirror has told us the file size,
+  // or that it won't
+  if((client.file_size != ~0ULL || client.streaming) && !client.finished) {
+    client.schedule_work();
+  }
+}
+
 void ares_timer_cb(uv_timer_t *timer) {
   auto &client = *reinterpret_cast<Client *>(timer->data);
   ares_process_fd(client.dns.channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
@@ -36,10 +102,15 @@ void ares_timer_cb(uv_timer_t *timer) {
 
 void query4_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
   (void)timeouts;
-  auto &res = *reinterpret_cast<Client::Resolution *>(arg);
+  auto &res = *reinterpret_cast<Mirror *>(arg);
+  if(res.failed) {
+    // Removed while the lookup was outstanding
+    return;
+  }
   if(status != ARES_SUCCESS) {
     if(status != ARES_EDESTRUCTION) {
       fprintf(stderr, "WARN: DNS resolution failed: %s: %s\n", res.host.c_str(), ares_strerror(status));
+      res.client.mirror_lost(res);
     }
     return;
   }
@@ -49,24 +120,31 @@ void query4_cb(void *arg, int status, int timeouts, unsigned char *abuf, int ale
   auto result = ares_parse_a_reply(abuf, alen, nullptr, addrs, &naddrs);
   if(result != ARES_SUCCESS) {
     fprintf(stderr, "WARN: Couldn't parse reply from DNS server: %s\n", ares_strerror(status));
+    res.client.mirror_lost(res);
     return;
   }
   if(naddrs == 0) {
     fprintf(stderr, "WARN: DNS lookup returned no addresses for %s\n", res.host.c_str());
+    res.client.mirror_lost(res);
     return;
   }
 
-  res.client.connections.emplace_back(res.client, res.req_host, res.path);
-  uv_tcp_init(&res.client.loop, &res.client.connections.back().handle);
-  res.client.connections.back().connect(addrs[0].ipaddr, res.port);
+  res.family = AF_INET;
+  res.ip4 = addrs[0].ipaddr;
+  res.client.reconnect(res);
 }
 
 void query6_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
   (void)timeouts;
-  auto &res = *reinterpret_cast<Client::Resolution *>(arg);
+  auto &res = *reinterpret_cast<Mirror *>(arg);
+  if(res.failed) {
+    // Removed while the lookup was outstanding
+    return;
+  }
   if(status != ARES_SUCCESS) {
     if(status != ARES_EDESTRUCTION) {
       fprintf(stderr, "WARN: DNS resolution failed: %s: %s\n", res.host.c_str(), ares_strerror(status));
+      res.client.mirror_lost(res);
     }
     return;
   }
@@ -76,45 +154,353 @@ void query6_cb(void *arg, int status, int timeouts, unsigned char *abuf, int ale
   auto result = ares_parse_aaaa_reply(abuf, alen, nullptr, addrs, &naddrs);
   if(result != ARES_SUCCESS) {
     fprintf(stderr, "WARN: Couldn't parse reply from DNS server: %s\n", ares_strerror(status));
+    res.client.mirror_lost(res);
     return;
   }
   if(naddrs == 0) {
     fprintf(stderr, "WARN: DNS lookup returned no addresses for %s\n", res.host.c_str());
+    res.client.mirror_lost(res);
     return;
   }
 
-  res.client.connections.emplace_back(res.client, res.host + ":" + std::to_string(res.port), res.path);
-  uv_tcp_init(&res.client.loop, &res.client.connections.back().handle);
-  res.client.connections.back().connect(*reinterpret_cast<in6_addr*>(&addrs[0].ip6addr), res.port);
+  res.family = AF_INET6;
+  res.ip6 = *reinterpret_cast<in6_addr*>(&addrs[0].ip6addr);
+  res.client.reconnect(res);
 }
-void print_bytes(uint64_t bytes) {
-  uint8_t exponent = log(bytes) / log(1024);
-  if(exponent == 0) {
-    printf("%" PRIu64 "B", bytes);
-    return;
+// How long probing waits for slow mirrors once the first one has answered
+const uint64_t PROBE_WINDOW = 2000;
+
+// Autoscaling measures throughput over this many milliseconds; long enough
+// for added connections to get through their handshakes and HEAD
+const uint64_t SCALE_INTERVAL = 2000;
+// Steady intervals between probes for one more connection
+const unsigned SCALE_PROBE = 5;
+
+// Milliseconds between refills of the rate limit's token bucket
+const uint64_t RATE_TICK = 20;
+
+// Longest tail the end-game fetches twice, which also bounds a duplicate's
+// scratch buffer; longer claims are split instead
+const size_t ENDGAME_TAIL = 4 * 1024 * 1024;
+
+// Used when the whole file can't be mapped at once
+const uint64_t FALLBACK_WINDOW = 64 * 1024 * 1024;
+
+uint8_t *map_file(int fd, size_t off, size_t len, bool populate) {
+  void *data = mmap(nullptr, len, PROT_WRITE, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, off);
+  if(data == MAP_FAILED) {
+    return nullptr;
   }
-  const static char abbrevs[] = "KMGTPE";
-  if(exponent - 1 >= elementsof(abbrevs)) {
-    printf("%.1fEiB", bytes / pow(1024, 6));
-    return;
+  if(populate) {
+    // Only a hint; most filesystems can't back shared mappings with huge pages
+    madvise(data, len, MADV_HUGEPAGE);
   }
-  char abbrev = abbrevs[exponent - 1];
-  printf("%.1f%ciB", bytes / pow(1024, exponent), abbrev);
+  return static_cast<uint8_t *>(data);
 }
+
+// Faults in the pages of a range about to be received, on kernels that can
+// do it without touching them
+void prefault(uint8_t *data, size_t len) {
+#ifdef MADV_POPULATE_WRITE
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  uint8_t *start = data - reinterpret_cast<uintptr_t>(data) % page_size;
+  madvise(start, data + len - start, MADV_POPULATE_WRITE);
+#else
+  (void)data;
+  (void)len;
+#endif
+}
+
+}
+
+Client::Client(uv_loop_t *external) : loop(external != nullptr ? external : &own_loop) {
+  if(external == nullptr) {
+    uv_loop_init(&own_loop);
+  }
+}
+
+void Client::init_handles() {
+  uv_timer_init(loop, &ares_timer);
+  ares_timer.data = this;
+  uv_timer_init(loop, &autotune_timer);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&autotune_timer));
+  autotune_timer.data = this;
+  uv_timer_init(loop, &mirror_timer);
+  mirror_timer.data = this;
+  uv_check_init(loop, &loop_check);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&loop_check));
+  loop_check.data = this;
+  uv_check_start(&loop_check, loop_check_cb);
+  uv_timer_init(loop, &scale_timer);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&scale_timer));
+  scale_timer.data = this;
+  uv_timer_init(loop, &rate_timer);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&rate_timer));
+  rate_timer.data = this;
+  uv_async_init(loop, &cancel_async, cancel_cb);
+  // Waiting for cancellation alone shouldn't keep the loop running
+  uv_unref(reinterpret_cast<uv_handle_t *>(&cancel_async));
+  cancel_async.data = this;
+  handles_ready = true;
+
+  std::lock_guard<std::mutex> lock(cancel_mutex);
+  cancel_open = true;
+  if(cancel_requested) {
+    // cancel() came first; deliver it from the loop like any other
+    uv_async_send(&cancel_async);
+  }
 }
 
 Client::~Client() {
-  if(fd != -1) {
+  join();
+  if(file_data != nullptr && file_data != output_buffer) {
     munmap(file_data, file_size);
+  }
+  if(fd != -1 && fd != output_fd) {
     close(fd);
   }
-  uv_loop_close(&loop);
+  if(loop == &own_loop) {
+    uv_loop_close(loop);
+  }
+}
+
+bool Client::add_url(const char *text) {
+  Url url(text);
+  if(url.transport() == Url::Transport::UNSUPPORTED) {
+    fprintf(stderr, "WARN: Skipping URL with unsupported scheme %s\n", std::string(url.scheme.base, url.scheme.len).c_str());
+    return false;
+  }
+
+  if(url.host.base == nullptr || url.host.len == 0) {
+    fprintf(stderr, "WARN: Skipping URL with no host component\n(did you forget the leading \"//\"?)\n");
+    return false;
+  }
+
+  const in_port_t port = url.port.base == nullptr ? url.default_port() : strtol(url.port.base, nullptr, 10);
+  if(port == 0) {
+    fprintf(stderr, "WARN: Skipping URL with invalid port: %s\n", std::string(url.port.base, url.port.len).c_str());
+    return false;
+  }
+
+  std::string path = url.path.base != nullptr ? std::string(url.path.base, url.path.len) : "/";
+  open(std::string(url.host.base, url.host.len) + (url.port.base ? ":" + std::string(url.port.base, url.port.len) : ""),
+       std::string(url.host.base, url.host.len), port, std::move(path),
+       url.transport() == Url::Transport::HTTPS);
+  return true;
+}
+
+const char *Client::start() {
+  const char *err = nullptr;
+  if(file_name == nullptr && output_fd == -1 && output_buffer == nullptr) {
+    err = "no destination given";
+  } else if(mirrors.empty()) {
+    err = "no usable URLs";
+  } else if(int result = ares.start()) {
+    err = ares_strerror(result);
+  } else if(int result = dns.start()) {
+    err = ares_strerror(result);
+  } else {
+    err = tls.start(ca_file);
+  }
+  if(err == nullptr && checksum_spec != nullptr) {
+    err = checksum.start(checksum_spec);
+  }
+  if(err == nullptr) {
+    // Nothing touches the loop until here, so a Client that fails the checks
+    // above reports on_done at once and leaves nothing behind
+    init_handles();
+  }
+  if(err == nullptr && control_path != nullptr) {
+    err = control.start(control_path);
+  }
+  if(err != nullptr) {
+    finish(err);
+    return err;
+  }
+
+  started = true;
+  if(rate_limit != 0) {
+    set_rate_limit(rate_limit);
+  }
+  for(auto &mirror : mirrors) {
+    resolve(mirror);
+  }
+  ares_stage();
+  return nullptr;
+}
+
+void Client::start_thread() {
+  thread = std::thread([this] {
+      start();
+      uv_run(loop, UV_RUN_DEFAULT);
+    });
+}
+
+void Client::join() {
+  if(thread.joinable()) {
+    thread.join();
+  }
+}
+
+void Client::cancel() {
+  // finish() may be closing the async handle on the loop's thread
+  std::lock_guard<std::mutex> lock(cancel_mutex);
+  cancel_requested = true;
+  if(cancel_open) {
+    uv_async_send(&cancel_async);
+  }
+}
+
+void Client::finish(std::string reason) {
+  if(finished) {
+    return;
+  }
+  finished = true;
+  error = std::move(reason);
+  // Hashes whatever is left; maybe_done waits for it, then finalize
+  // updates the cache
+  checksum.finish();
+
+  // Closing moves connections between states, so work from a snapshot
+  std::vector<Connection *> live;
+  for(const auto &set : by_state) {
+    live.insert(live.end(), set.begin(), set.end());
+  }
+  for(auto conn : live) {
+    if(!uv_is_closing(reinterpret_cast<uv_handle_t *>(&conn->handle))) {
+      conn->set_state(error.empty() ? Connection::State::COMPLETE : Connection::State::CANCELLED);
+      conn->close();
+    }
+  }
+
+  if(started) {
+    ares_cancel(dns.channel);
+  }
+  for(auto poll : ares_polls) {
+    ares_close(poll);
+  }
+  ares_polls.clear();
+  control.close();
+  if(!handles_ready) {
+    maybe_done();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(cancel_mutex);
+    cancel_open = false;
+  }
+  for(auto handle : {reinterpret_cast<uv_handle_t *>(&ares_timer), reinterpret_cast<uv_handle_t *>(&autotune_timer),
+                     reinterpret_cast<uv_handle_t *>(&mirror_timer), reinterpret_cast<uv_handle_t *>(&scale_timer),
+                     reinterpret_cast<uv_handle_t *>(&rate_timer), reinterpret_cast<uv_handle_t *>(&loop_check),
+                     reinterpret_cast<uv_handle_t *>(&cancel_async)}) {
+    ++closing_handles;
+    uv_close(handle, client_close_cb);
+  }
+}
+
+void Client::handle_closed() {
+  --closing_handles;
+  maybe_done();
+}
+
+void Client::maybe_done() {
+  if(!finished || reported || closing_handles != 0 || live_sessions != 0 || checksum.busy() || cache_busy ||
+     free_connections.size() != connections.size()) {
+    return;
+  }
+  if(!finalized) {
+    finalized = true;
+    finalize();
+    if(cache_busy) {
+      // Reported once the cache has its copy
+      return;
+    }
+  }
+  reported = true;
+  if(on_done) {
+    on_done(*this, error.empty() ? nullptr : error.c_str());
+  }
+}
+
+void Client::finalize() {
+  bool checked = error.empty();
+  if(checked) {
+    error = checksum.verify();
+  }
+  if(cache_dir != nullptr && output_ready && !streaming && !cache_key.empty()) {
+    if(checked && !error.empty()) {
+      // Some piece is corrupt, perhaps one the cache supplied
+      PieceCache(cache_dir, cache_limit).remove(cache_key);
+    } else if((checked || !checksum.active()) && completed.size() != cache_supplied) {
+      // Completed ranges are final even if the download as a whole failed,
+      // unless there's a checksum they can't be held to. A file larger than
+      // the cache keeps only what fits.
+      cache_ranges.clear();
+      uint64_t budget = cache_limit;
+      for(auto it = completed.begin(); it != completed.end() && budget != 0; ++it) {
+        uint64_t len = std::min(it->second - it->first, budget);
+        cache_ranges.insert(Chunk{it->first, len});
+        budget -= len;
+      }
+      if(!cache_ranges.empty()) {
+        // Copying can take a while without reflinks, and other downloads
+        // may share the loop
+        cache_busy = true;
+        cache_work.data = this;
+        uv_queue_work(loop, &cache_work, cache_work_cb, cache_done_cb);
+      }
+    }
+  }
+  if(part_name.empty()) {
+    return;
+  }
+  if(!error.empty()) {
+    unlink(part_name.c_str());
+    return;
+  }
+
+  // Data first, then the name, then the directory entry the name lives in
+  if(fsync(fd) != 0) {
+    error = "Failed to sync " + part_name + ": " + strerror(errno);
+    unlink(part_name.c_str());
+    return;
+  }
+  // Never replaces a file that appeared under the name during the download
+  int published = renameat2(AT_FDCWD, part_name.c_str(), AT_FDCWD, file_name, RENAME_NOREPLACE);
+  if(published != 0 && (errno == EINVAL || errno == ENOSYS)) {
+    // The filesystem or kernel can't; a hard link can't replace anything either
+    published = link(part_name.c_str(), file_name);
+    if(published == 0) {
+      unlink(part_name.c_str());
+    }
+  }
+  if(published != 0) {
+    error = "Failed to rename " + part_name + " to " + file_name + ": " + strerror(errno);
+    unlink(part_name.c_str());
+    return;
+  }
+  const char *slash = strrchr(file_name, '/');
+  std::string dir = slash == nullptr ? "." : slash == file_name ? "/" : std::string(file_name, slash);
+  int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dir_fd != -1) {
+    fsync(dir_fd);
+    ::close(dir_fd);
+  }
+}
+
+void Client::ares_close(AresPoll *poll) {
+  ++closing_handles;
+  uv_close(reinterpret_cast<uv_handle_t *>(&poll->handle), ares_close_cb);
 }
 
 void Client::ares_stage() {
+  if(finished) {
+    return;
+  }
   uv_timer_stop(&ares_timer);
-  for(auto &poll : ares_polls) {
-    uv_poll_stop(&poll.handle);
+  // c-ares may have swapped sockets out from under existing polls
+  for(auto poll : ares_polls) {
+    ares_close(poll);
   }
   ares_polls.clear();
 
@@ -129,160 +515,798 @@ void Client::ares_stage() {
   FD_ZERO(&write_fds);
   int nfds = ares_fds(dns.channel, &read_fds, &write_fds);
 
-  ares_polls.reserve(nfds);
   for(int fd = 0; fd < nfds; ++fd) {
-    if(FD_ISSET(fd, &read_fds)) {
-      ares_polls.emplace_back(AresPoll{{}, fd, dns.channel});
-      uv_poll_init(&loop, &ares_polls.back().handle, fd);
-      ares_polls.back().handle.data = this;
-      uv_poll_start(&ares_polls.back().handle, UV_READABLE, ares_process_cb);
+    // libuv allows only one poll per descriptor
+    int events = (FD_ISSET(fd, &read_fds) ? UV_READABLE : 0) | (FD_ISSET(fd, &write_fds) ? UV_WRITABLE : 0);
+    if(events != 0) {
+      auto poll = new AresPoll{{}, fd, *this};
+      uv_poll_init(loop, &poll->handle, fd);
+      uv_poll_start(&poll->handle, events, ares_process_cb);
+      ares_polls.push_back(poll);
+    }
+  }
+}
+
+void Client::init_file() {
+  output_ready = true;
+  if(output_buffer == nullptr && output_fd != -1) {
+    fd = output_fd;
+  } else if(output_buffer == nullptr) {
+    // Written aside so nothing sees a partial file under the final name
+    std::string part = std::string(file_name) + ".part";
+    struct stat st;
+    if(lstat(file_name, &st) == 0) {
+      finish(std::string("Failed to open file ") + file_name + " for writing: " + strerror(EEXIST));
+      return;
+    }
+    const int flags = O_RDWR | O_CREAT | O_EXCL, mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    fd = ::open(part.c_str(), flags, mode);
+    if(fd == -1 && errno == EEXIST && lstat(part.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      // Left by a run that was killed; nothing resumes from it
+      unlink(part.c_str());
+      fd = ::open(part.c_str(), flags, mode);
+    }
+    if(fd == -1) {
+      finish("Failed to open file " + part + " for writing: " + strerror(errno));
+      return;
+    }
+    // Only once it's ours, since finalize removes it on failure
+    part_name = std::move(part);
+  }
+  if(autotune_sockets) {
+    last_autotune = uv_now(loop);
+    uv_timer_start(&autotune_timer, autotune_cb, 500, 500);
+  }
+  if(autoscale_max > 1) {
+    scale_bytes = completed.size();
+    uv_timer_start(&scale_timer, scale_timer_cb, SCALE_INTERVAL, SCALE_INTERVAL);
+  }
+  if(streaming) {
+    // Grows as the stream arrives; nothing to allocate or map yet
+    return;
+  }
+  prepare_output();
+}
+
+bool Client::prepare_output() {
+  assert(file_size != ~0ULL);
+  if(output_buffer != nullptr) {
+    if(output_capacity < file_size) {
+      finish("output buffer is smaller than the file");
+      return false;
+    }
+    // Nothing to map or splice into
+    file_data = output_buffer;
+    window_size = 0;
+    splice = false;
+  } else {
+    {
+      int result = posix_fallocate(fd, 0, file_size);
+      if(result != 0) {
+        fprintf(stderr, "FATAL: Couldn't allocate %lu bytes of file space for output: %s\n", file_size, strerror(result));
+      }
     }
 
-    if(FD_ISSET(fd, &write_fds)) {
-      ares_polls.emplace_back(AresPoll{{}, fd, dns.channel});
-      uv_poll_init(&loop, &ares_polls.back().handle, fd);
-      ares_polls.back().handle.data = this;
-      uv_poll_start(&ares_polls.back().handle, UV_WRITABLE, ares_process_cb);
+    if(window_size == 0) {
+      // Prefaulting all of it would stall here and pin the file in memory;
+      // map_window prefaults each range as it's claimed instead
+      file_data = map_file(fd, 0, file_size, false);
+      if(file_data != nullptr && populate) {
+        madvise(file_data, file_size, MADV_HUGEPAGE);
+      }
+      if(file_data == nullptr) {
+        if(errno != ENOMEM) {
+          finish(std::string("mmap: ") + strerror(errno));
+          return false;
+        }
+        fprintf(stderr, "WARN: Couldn't map the whole output file, mapping it in windows instead: %s\n", strerror(errno));
+        window_size = FALLBACK_WINDOW;
+      }
     }
   }
+  pending.insert(Chunk{0, file_size});
+  if(seed_file != nullptr && block_map_file != nullptr) {
+    apply_seed();
+  }
+  if(cache_dir != nullptr && !cache_key.empty() && !finished) {
+    fill_from_cache();
+  }
+  return !finished;
 }
 
-void Client::init_file() {
-  assert(file_size != ~0UL);
-  fd = ::open(file_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-  if(fd == -1) {
-    fprintf(stderr, "FATAL: Failed to open file %s for writing: %s\n", file_name, strerror(errno));
-    exit(1);
+void Client::fill_from_cache() {
+  PieceCache cache(cache_dir, cache_limit);
+  IntervalSet supplied = cache.fetch(cache_key, file_size, fd, output_buffer);
+  for(const auto &range : supplied) {
+    Chunk chunk{range.first, range.second - range.first};
+    pending.erase(chunk);
+    completed.insert(chunk);
   }
+  cache_supplied = completed.size();
+  stats.bytes = completed.size();
+  stats.start_time = uv_now(loop);
+}
 
-  {
-    int result = posix_fallocate(fd, 0, file_size);
-    if(result != 0) {
-      fprintf(stderr, "FATAL: Couldn't allocate %lu bytes of file space for output: %s\n", file_size, strerror(result));
+void Client::store_in_cache() {
+  PieceCache cache(cache_dir, cache_limit);
+  cache.store(cache_key, file_size, cache_ranges, fd, output_buffer);
+}
+
+void Client::apply_seed() {
+  BlockMap map;
+  if(const char *err = map.load(block_map_file)) {
+    fprintf(stderr, "WARN: Ignoring block map %s: %s\n", block_map_file, err);
+    return;
+  }
+  if(map.length != file_size) {
+    fprintf(stderr, "WARN: Ignoring block map for a file of %" PRIu64 " bytes, expected %" PRIu64 "\n", map.length,
+            file_size);
+    return;
+  }
+
+  if(!map.sha1.empty() && !checksum.active()) {
+    // Truncated block checksums can still be fooled; the whole-file digest
+    // catches a bad match before the file is published
+    if(const char *err = checksum.start(("sha1:" + map.sha1).c_str())) {
+      fprintf(stderr, "WARN: Ignoring SHA-1 from block map %s: %s\n", block_map_file, err);
     }
   }
 
-  file_data = static_cast<uint8_t *>(mmap(nullptr, file_size, PROT_WRITE, MAP_SHARED, fd, 0));
-  if(file_data == MAP_FAILED) {
-    fprintf(stderr, "FATAL: mmap: %s\n", strerror(errno));
-    abort();
+  int seed_fd = ::open(seed_file, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(seed_fd == -1 || fstat(seed_fd, &st) != 0) {
+    fprintf(stderr, "WARN: Couldn't open seed %s: %s\n", seed_file, strerror(errno));
+    if(seed_fd != -1) {
+      ::close(seed_fd);
+    }
+    return;
   }
-  chunks.push_back(Chunk{0, file_size});
-  schedule_work();
+  size_t seed_len = st.st_size;
+  void *seed = seed_len != 0 ? mmap(nullptr, seed_len, PROT_READ, MAP_PRIVATE, seed_fd, 0) : MAP_FAILED;
+  ::close(seed_fd);
+  if(seed == MAP_FAILED) {
+    fprintf(stderr, "WARN: Couldn't map seed %s: %s\n", seed_file, seed_len != 0 ? strerror(errno) : "empty file");
+    return;
+  }
+  madvise(seed, seed_len, MADV_SEQUENTIAL);
+
+  // Runs before any range is requested, so blocking the loop costs nothing
+  // that the transfer it saves doesn't repay
+  auto data = static_cast<const uint8_t *>(seed);
+  for(const auto &match : map.find(data, seed_len, std::max(std::thread::hardware_concurrency(), 1U))) {
+    Chunk block{match.block * map.block_size, 0};
+    block.len = std::min<uint64_t>(map.block_size, file_size - block.off);
+    if(file_data != nullptr) {
+      memcpy(file_data + block.off, data + match.seed_off, block.len);
+    } else if(pwrite(fd, data + match.seed_off, block.len, block.off) != static_cast<ssize_t>(block.len)) {
+      finish(std::string("Failed to write output: ") + strerror(errno));
+      break;
+    }
+    pending.erase(block);
+    completed.insert(block);
+  }
+  munmap(seed, seed_len);
+
+  // Rates should reflect the network, not the copy
+  stats.bytes = completed.size();
+  stats.start_time = uv_now(loop);
+}
+
+bool Client::go_parallel(uint64_t size) {
+  streaming = false;
+  file_size = size;
+  return prepare_output();
+}
+
+bool Client::write_stream(uint64_t off, const char *data, size_t len) {
+  if(output_buffer != nullptr) {
+    if(off + len > output_capacity) {
+      finish("output buffer is smaller than the file");
+      return false;
+    }
+    memcpy(output_buffer + off, data, len);
+    return true;
+  }
+
+  while(len != 0) {
+    ssize_t written = pwrite(fd, data, len, off);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      finish(std::string("Failed to write output: ") + strerror(errno));
+      return false;
+    }
+    data += written;
+    len -= written;
+    off += written;
+  }
+  return true;
+}
+
+void Client::end_stream(uint64_t size) {
+  file_size = size;
+  streaming = false;
+  // The last report should show the final size
+  last_progress = 0;
+  if(on_progress) {
+    on_progress(*this);
+  }
+  finish("");
+}
+
+bool Client::ranges_elsewhere(const Connection &conn) const {
+  for(auto state : {Connection::State::CONNECT, Connection::State::HEAD, Connection::State::IDLE,
+                    Connection::State::STANDBY, Connection::State::GET_HEADERS, Connection::State::GET_COPY,
+                    Connection::State::GET_DIRECT}) {
+    for(auto other : in_state(state)) {
+      if(other != &conn && other->mirror->ranges) {
+        return true;
+      }
+    }
+  }
+  return false;
 }
 
 void Client::schedule_work() {
-  balance_chunks();
-  if(file_data == nullptr) {
+  ScopedTimer timer(metrics.schedule_ns);
+  // Resuming schedules again
+  if(finished || paused) {
+    return;
+  }
+  if(!output_ready) {
     init_file();
+    if(finished) {
+      return;
+    }
+  }
+
+  if(probing && !select_mirrors()) {
+    return;
+  }
+
+  auto &idle = by_state[static_cast<size_t>(Connection::State::IDLE)];
+  if(mirror_limit != 0) {
+    // Walking backwards, swap-removal only moves connections already visited
+    for(size_t i = idle.size(); i-- > 0;) {
+      if(idle[i]->mirror->standby) {
+        idle[i]->set_state(Connection::State::STANDBY);
+      }
+    }
+  }
+
+  if(autoscale_max != 0) {
+    // Retire connections the controller no longer wants once they run out of work
+    for(size_t i = idle.size(); i-- > 0;) {
+      auto conn = idle[i];
+      if(conn->session == nullptr && conn->mirror->connections > scale_target) {
+        conn->set_state(Connection::State::COMPLETE);
+        conn->close();
+      }
+    }
+  }
+
+  if(streaming) {
+    // The others wait in case the stream reveals a size and range support
+    if(in_state(Connection::State::GET_STREAM).empty() && !idle.empty()) {
+      idle.back()->stream();
+    }
+    return;
+  }
+
+  if(!pending.empty()) {
+    // Active mirrors whose idle connections the server closed
+    for(auto &mirror : mirrors) {
+      if(!mirror.failed && !mirror.standby && mirror.family != 0 && mirror.connections == 0) {
+        reconnect(mirror);
+      }
+    }
+  }
+
+  while(!idle.empty() && !pending.empty()) {
+    idle.back()->get(take_chunk());
+  }
+
+  if(pending.empty() && !idle.empty()) {
+    // Split the largest claims so idle connections get work of their own;
+    // only HTTP/1.1 bodies read through libuv can be cut off at a new end
+    std::vector<Connection *> victims;
+    for(auto state : {Connection::State::GET_COPY, Connection::State::GET_DIRECT}) {
+      for(auto conn : in_state(state)) {
+        if(conn->session == nullptr && !conn->splicing && !conn->whole_body && conn->rival == nullptr &&
+           conn->scratch_dest == nullptr && static_cast<size_t>(conn->end - conn->begin) > ENDGAME_TAIL) {
+          victims.push_back(conn);
+        }
+      }
+    }
+    std::sort(victims.begin(), victims.end(), [](const Connection *a, const Connection *b) {
+        return a->end - a->begin > b->end - b->begin;
+      });
+    for(size_t i = 0; i < victims.size() && i < idle.size(); ++i) {
+      Chunk back = victims[i]->shorten();
+      release(back, back);
+    }
+    while(!idle.empty() && !pending.empty()) {
+      idle.back()->get(take_chunk());
+    }
   }
 
-  for(auto &conn : connections) {
-    if(conn.state == Connection::State::IDLE) {
-      if(chunks.empty()) {
+  if(pending.empty() && !idle.empty()) {
+    // End-game: race idle connections against the largest unfinished tails,
+    // small enough that fetching one twice costs little
+    std::vector<Connection *> targets;
+    for(auto state : {Connection::State::GET_HEADERS, Connection::State::GET_COPY, Connection::State::GET_DIRECT}) {
+      for(auto conn : in_state(state)) {
+        if(conn->rival == nullptr && conn->scratch_dest == nullptr && conn->begin != conn->end &&
+           static_cast<size_t>(conn->end - conn->begin) <= ENDGAME_TAIL &&
+           conn->file_offset(conn->end) == conn->claim_end()) {
+          targets.push_back(conn);
+        }
+      }
+    }
+    std::sort(targets.begin(), targets.end(), [](const Connection *a, const Connection *b) {
+        return a->end - a->begin > b->end - b->begin;
+      });
+    for(auto target : targets) {
+      if(idle.empty()) {
         break;
       }
-      conn.get(chunks.back());
-      chunks.pop_back();
+      idle.back()->duplicate(*target);
     }
   }
 
-  for(auto &conn : connections) {
-    if(conn.state != Connection::State::IDLE && conn.state != Connection::State::FAILED)
+  for(auto state : {Connection::State::CONNECT, Connection::State::HEAD, Connection::State::GET_HEADERS,
+                    Connection::State::GET_COPY, Connection::State::GET_DIRECT, Connection::State::GET_STREAM}) {
+    if(!in_state(state).empty())
       return;
   }
 
-  for(auto &conn : connections) {
-    if(conn.state == Connection::State::IDLE) {
-      conn.close();
+  if(!pending.empty()) {
+    // Waiting on DNS or a promotion; mirror_lost gives up once none remain
+    return;
+  }
+
+  // Nothing left in flight; idle and standby connections are done
+  finish("");
+}
+
+bool Client::select_mirrors() {
+  // Wait for every mirror to be probed or fail, within reason
+  auto now = uv_now(loop);
+  bool waiting = false;
+  for(const auto &mirror : mirrors) {
+    if(!mirror.probed && !mirror.failed) {
+      waiting = true;
+    }
+  }
+  if(waiting) {
+    if(probe_start == 0) {
+      probe_start = now;
+    }
+    if(now - probe_start < PROBE_WINDOW) {
+      // Re-armed every time, as deferred scheduling shares the timer
+      uv_timer_start(&mirror_timer, mirror_timer_cb, PROBE_WINDOW - (now - probe_start), 0);
+      return false;
+    }
+  }
+  uv_timer_stop(&mirror_timer);
+  probing = false;
+
+  std::vector<Mirror *> ranked;
+  for(auto &mirror : mirrors) {
+    mirror.standby = true;
+    if(mirror.probed && !mirror.failed) {
+      ranked.push_back(&mirror);
     }
   }
+  std::sort(ranked.begin(), ranked.end(), [](const Mirror *a, const Mirror *b) {
+      return a->score() < b->score();
+    });
+  for(size_t i = 0; i < ranked.size() && i < mirror_limit; ++i) {
+    ranked[i]->standby = false;
+  }
+  return true;
 }
 
-void Client::balance_chunks() {
-  if(chunks.empty())
+void Client::mirror_lost(Mirror &mirror) {
+  if(finished) {
     return;
+  }
+  mirror.failed = true;
+  if(!probing && !mirror.standby) {
+    // Promote the best standby that still has connections to offer
+    Mirror *best = nullptr;
+    for(auto &candidate : mirrors) {
+      // Dormant standbys count; only those still resolving don't
+      if(!candidate.standby || candidate.failed || (candidate.connections == 0 && candidate.family == 0)) {
+        continue;
+      }
+      if(best == nullptr || (candidate.probed && !best->probed) ||
+         (candidate.probed == best->probed && candidate.score() < best->score())) {
+        best = &candidate;
+      }
+    }
+    if(best != nullptr) {
+      best->standby = false;
+      auto standby = in_state(Connection::State::STANDBY);
+      for(auto conn : standby) {
+        if(conn->mirror == best) {
+          conn->set_state(Connection::State::IDLE);
+        }
+      }
+      if(best->connections == 0) {
+        reconnect(*best);
+      }
+    }
+  }
 
-  size_t available_connections = 0;
-  for(auto &conn : connections) {
-    if(conn.state <= Connection::State::IDLE)
-      ++available_connections;
+  bool alive = false;
+  for(const auto &candidate : mirrors) {
+    if(!candidate.failed || candidate.connections != 0) {
+      alive = true;
+    }
   }
-  if(available_connections == 0)
+  if(!alive) {
+    finish("no mirror could serve the file");
     return;
+  }
 
-  std::vector<Chunk> concat(chunks.begin(), chunks.begin() + 1);
+  // Released ranges and promoted connections need scheduling, but not from
+  // deep inside whatever callback noticed the failure
+  defer_schedule();
+}
 
-  // Merge adjacent chunks and compute total size remaining
-  size_t bytes = chunks[0].len;
-  for(auto it = chunks.begin() + 1; it != chunks.end(); ++it) {
-    bytes += it->len;
-    if(concat.back().off + concat.back().len == it->off) {
-      concat.back().len += it->len;
+void Client::mirror_dormant(Mirror &mirror) {
+  // A standby reconnects when it's promoted, and an active mirror once
+  // schedule_work finds work for it
+  if(!finished && !mirror.standby) {
+    defer_schedule();
+  }
+}
+
+void Client::reconnect(Mirror &mirror) {
+  if(http2 && !mirror.tls) {
+    auto &session = open_session(mirror);
+    if(mirror.family == AF_INET6) {
+      session.connect(mirror.ip6, mirror.port);
     } else {
-      concat.emplace_back(*it);
+      session.connect(mirror.ip4, mirror.port);
     }
+  } else {
+    add_connection(mirror);
   }
+}
 
-  // Split evenly
-  chunks.clear();
-  const size_t max_chunk_size = bytes / available_connections;
-  for(auto &chunk : concat) {
-    size_t divisor = 1;
-    while(chunk.len / divisor > max_chunk_size)
-      ++divisor;
-    size_t accum = chunk.off;
-    for(size_t i = 0; i < divisor; ++i) {
-      auto len = chunk.len / divisor + (i < chunk.len % divisor ? 1 : 0);
-      chunks.push_back(Chunk{accum, len});
-      accum += len;
+void Client::defer_schedule() {
+  uv_timer_start(&mirror_timer, mirror_timer_cb, 0, 0);
+}
+
+void Client::autotune() {
+  auto now = uv_now(loop);
+  auto interval = now - last_autotune;
+  last_autotune = now;
+  if(interval == 0) {
+    return;
+  }
+
+  for(auto state : {Connection::State::GET_COPY, Connection::State::GET_DIRECT, Connection::State::GET_STREAM}) {
+    for(auto conn : in_state(state)) {
+      // HTTP/2 streams share a socket and tune their stream windows instead
+      if(conn->session == nullptr) {
+        conn->autotune(interval);
+      }
     }
   }
 }
 
-void Client::open(std::string req_host, std::string host, in_port_t port, std::string path) {
-  resolutions.emplace_back(
-    Resolution{std::move(req_host), std::move(host), port, std::move(path), *this});
-  ares_query(dns.channel, resolutions.back().host.c_str(), ns_c_in, ns_t_a, query4_cb, &resolutions.back());
-  //ares_query(dns.channel, resolutions.back().host.c_str(), ns_c_in, ns_t_aaaa, query6_cb, &resolutions.back());
-  (void)query6_cb;
+void Client::autoscale() {
+  uint64_t rate = (completed.size() - scale_bytes) * 1000 / SCALE_INTERVAL;
+  scale_bytes = completed.size();
+  bool errors = failures != scale_failures;
+  scale_failures = failures;
+  // Claims in flight still count: schedule_work splits them for new connections
+  uint64_t remaining = file_size - completed.size();
+  if(streaming || paused || remaining <= ENDGAME_TAIL || (rate == 0 && scale_rate == 0)) {
+    // Nothing more connections could speed up, or nothing to measure yet
+    return;
+  }
+
+  unsigned next = scale_target;
+  if(errors || rate * 10 < scale_rate * 8) {
+    next = std::max(1U, scale_target / 2);
+    scale_slow_start = false;
+    scale_steady = 0;
+    scale_probe_base = 0;
+  } else if(scale_slow_start) {
+    if(rate * 10 >= scale_rate * 11) {
+      next = scale_target * 2;
+    } else {
+      // Gains have flattened
+      scale_slow_start = false;
+    }
+  } else if(scale_probe_base != 0) {
+    if(rate * 20 < scale_probe_base * 21) {
+      // The last probe didn't pay for itself
+      next = scale_target - 1;
+    }
+    scale_probe_base = 0;
+  } else if(++scale_steady == SCALE_PROBE) {
+    scale_steady = 0;
+    scale_probe_base = rate;
+    next = scale_target + 1;
+  }
+  scale_rate = rate;
+  scale_target = std::max(1U, std::min(next, autoscale_max));
+  grow_connections();
 }
 
-void Client::progress(uint64_t bytes) {
-  auto now = uv_now(&loop);
-  if(stats.bytes == 0) {
-    stats.start_time = now;
+void Client::grow_connections() {
+  // Surplus connections retire in schedule_work as they go idle
+  for(auto &mirror : mirrors) {
+    if(mirror.failed || mirror.standby || mirror.family == 0 || (http2 && !mirror.tls)) {
+      continue;
+    }
+    while(mirror.connections < scale_target) {
+      add_connection(mirror);
+    }
   }
-  stats.bytes += bytes;
+}
 
-  // cursor horizontal absolute 0 - erase in line - print
-  printf("\x1B[0G" "\x1B[K" "%.1f%%", 100.f * (double)stats.bytes / (double)file_size);
+void Client::add_connection(Mirror &mirror) {
+  auto &conn = create_connection(mirror, mirror.req_host, mirror.path, mirror.tls ? mirror.host : "");
+  if(mirror.family == AF_INET6) {
+    conn.connect(mirror.ip6, mirror.port);
+  } else {
+    conn.connect(mirror.ip4, mirror.port);
+  }
+}
 
-  {
-    uint64_t dt = now - stats.start_time;
-    printf(" - %" PRIu64 "s", dt / 1000);
-    if(dt != 0) {
-      printf(" - ");
-      print_bytes(stats.bytes / dt * 1000);
-      printf("/s = ");
-    }
-  }
-
-  bool first = true;
-  for(auto &conn : connections) {
-    if(conn.state == Connection::State::GET_COPY || conn.state == Connection::State::GET_DIRECT) {
-      auto dt = now - conn.stats.start_time;
-      if(dt != 0) {
-        if(!first) {
-          printf(" + ");
-        } else {
-          first = false;
-        }
-        print_bytes(conn.stats.bytes / dt * 1000);
-        printf("/s");
+void Client::remove_mirror(Mirror &mirror) {
+  if(mirror.connections == 0) {
+    // Still resolving; its lookup sees the flag and gives up
+    mirror_lost(mirror);
+    return;
+  }
+  // Set first so nothing opens new connections to it; the last close calls
+  // mirror_lost, which promotes a standby and reschedules released ranges
+  mirror.failed = true;
+  std::vector<Connection *> doomed;
+  for(const auto &set : by_state) {
+    for(auto conn : set) {
+      if(conn->mirror == &mirror && !uv_is_closing(reinterpret_cast<uv_handle_t *>(&conn->handle))) {
+        doomed.push_back(conn);
+      }
+    }
+  }
+  for(auto conn : doomed) {
+    conn->set_state(Connection::State::CANCELLED);
+    conn->close();
+  }
+}
+
+void Client::set_rate_limit(uint64_t limit) {
+  rate_limit = limit;
+  if(limit == 0) {
+    uv_timer_stop(&rate_timer);
+  } else if(!uv_is_active(reinterpret_cast<uv_handle_t *>(&rate_timer))) {
+    rate_tokens = limit * RATE_TICK / 1000;
+    last_refill = uv_now(loop);
+    uv_timer_start(&rate_timer, rate_timer_cb, RATE_TICK, RATE_TICK);
+  }
+  update_reading();
+}
+
+void Client::set_connection_target(unsigned target) {
+  uv_timer_stop(&scale_timer);
+  autoscale_max = scale_target = target;
+  grow_connections();
+  // Lets idle connections beyond the target retire
+  if(output_ready) {
+    defer_schedule();
+  }
+}
+
+void Client::set_paused(bool pause) {
+  paused = pause;
+  update_reading();
+  if(!paused && output_ready) {
+    defer_schedule();
+  }
+}
+
+void Client::account_read(size_t bytes) {
+  if(rate_limit == 0) {
+    return;
+  }
+  rate_tokens -= bytes;
+  if(rate_tokens <= 0 && reading) {
+    update_reading();
+  }
+}
+
+void Client::update_reading() {
+  bool want = !paused && (rate_limit == 0 || rate_tokens > 0);
+  if(want == reading) {
+    return;
+  }
+  reading = want;
+  for(const auto &set : by_state) {
+    for(auto conn : set) {
+      conn->watch();
+      if(reading && conn->state != Connection::State::CONNECT) {
+        // Time spent stopped isn't the server's fault
+        conn->extend_timeout(conn->state == Connection::State::HEAD || conn->state == Connection::State::GET_HEADERS ?
+                             header_timeout : idle_timeout);
+      }
+    }
+  }
+  for(auto session : sessions) {
+    session->watch();
+  }
+}
+
+Connection &Client::create_connection(Mirror &mirror, std::string host, std::string path, std::string server_name) {
+  Connection *conn;
+  if(!free_connections.empty()) {
+    conn = free_connections.back();
+    free_connections.pop_back();
+    conn->~Connection();
+    new (conn) Connection(*this, std::move(host), std::move(path), std::move(server_name));
+  } else {
+    connections.emplace_back(*this, std::move(host), std::move(path), std::move(server_name));
+    conn = &connections.back();
+  }
+  uv_tcp_init(loop, &conn->handle);
+  uv_timer_init(loop, &conn->timer);
+  conn->mirror = &mirror;
+  ++mirror.connections;
+
+  auto &set = by_state[static_cast<size_t>(conn->state)];
+  conn->state_index = set.size();
+  set.push_back(conn);
+  return *conn;
+}
+
+Http2Session &Client::open_session(Mirror &res) {
+  // Deleted by its close callback once every stream has detached
+  auto session = new Http2Session(*this, res.req_host, res.path);
+  ++live_sessions;
+  sessions.push_back(session);
+  for(unsigned i = 0; i < std::max(streams_per_session, 1U); ++i) {
+    session->add_stream(create_connection(res, res.req_host, res.path, ""));
+  }
+  return *session;
+}
+
+bool Client::map_window(Connection &conn, Chunk chunk) {
+  assert(conn.mapping == nullptr);
+  if(file_data != nullptr) {
+    conn.mapping = file_data;
+    conn.mapping_off = 0;
+    conn.mapping_len = file_size;
+    if(populate) {
+      prefault(file_data + chunk.off, chunk.len);
+    }
+    return true;
+  }
+
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  conn.mapping_off = chunk.off - chunk.off % page_size;
+  conn.mapping_len = chunk.off + chunk.len - conn.mapping_off;
+  conn.mapping = map_file(fd, conn.mapping_off, conn.mapping_len, populate);
+  if(conn.mapping == nullptr) {
+    finish(std::string("mmap: ") + strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void Client::unmap_window(Connection &conn) {
+  if(conn.mapping != nullptr && conn.mapping != file_data) {
+    munmap(conn.mapping, conn.mapping_len);
+  }
+  conn.mapping = nullptr;
+  conn.mapping_off = conn.mapping_len = 0;
+}
+
+void Client::transition(Connection &conn, Connection::State from, Connection::State to) {
+  auto &src = by_state[static_cast<size_t>(from)];
+  assert(src[conn.state_index] == &conn);
+  src[conn.state_index] = src.back();
+  src[conn.state_index]->state_index = conn.state_index;
+  src.pop_back();
+
+  auto &dst = by_state[static_cast<size_t>(to)];
+  conn.state_index = dst.size();
+  dst.push_back(&conn);
+
+  if(to == Connection::State::FAILED) {
+    ++failures;
+  }
+}
+
+void Client::recycle(Connection &conn) {
+  auto &src = by_state[static_cast<size_t>(conn.state)];
+  assert(src[conn.state_index] == &conn);
+  src[conn.state_index] = src.back();
+  src[conn.state_index]->state_index = conn.state_index;
+  src.pop_back();
+
+  free_connections.push_back(&conn);
+  maybe_done();
+}
+
+Chunk Client::take_chunk() {
+  assert(!pending.empty());
+
+  // Leave an even share of what's left for every connection that will want work soon
+  size_t available_connections =
+    in_state(Connection::State::CONNECT).size() +
+    in_state(Connection::State::HEAD).size() +
+    in_state(Connection::State::IDLE).size();
+  if(autoscale_max != 0 && scale_slow_start) {
+    // Also leave shares for the connections the next doubling will add;
+    // otherwise they can only split claims already in flight
+    unsigned planned = std::min(2 * scale_target, autoscale_max);
+    for(const auto &mirror : mirrors) {
+      if(!mirror.failed && !mirror.standby && mirror.family != 0 && !(http2 && !mirror.tls) &&
+         mirror.connections < planned) {
+        available_connections += planned - mirror.connections;
       }
     }
   }
+  if(available_connections == 0)
+    available_connections = 1;
+
+  size_t share = (pending.size() + available_connections - 1) / available_connections;
+  if(window_size != 0 && share > window_size) {
+    // Keep each connection's mapping bounded
+    share = window_size;
+  }
+  auto first = pending.first();
+  Chunk chunk{first.off, std::min(first.len, share)};
+  pending.erase(chunk);
+  in_flight.insert(chunk);
+  return chunk;
+}
+
+void Client::release(Chunk claim, Chunk leftover) {
+  in_flight.erase(claim);
+  pending.insert(leftover);
+}
+
+void Client::open(std::string req_host, std::string host, in_port_t port, std::string path, bool tls) {
+  mirrors.emplace_back(std::move(req_host), std::move(host), port, std::move(path), tls, *this);
+  // Mirrors discovered after selection, e.g. through redirects, wait their turn
+  mirrors.back().standby = mirror_limit != 0 && !probing;
+  if(started) {
+    resolve(mirrors.back());
+    // Watch the new query's socket
+    ares_stage();
+  }
+}
 
-  fflush(stdout);
+void Client::resolve(Mirror &mirror) {
+  ares_query(dns.channel, mirror.host.c_str(), ns_c_in, ns_t_a, query4_cb, &mirror);
+  //ares_query(dns.channel, mirror.host.c_str(), ns_c_in, ns_t_aaaa, query6_cb, &mirror);
+  (void)query6_cb;
+}
+
+void Client::progress(Chunk chunk) {
+  auto now = uv_now(loop);
+  if(stats.bytes == 0) {
+    stats.start_time = now;
+  }
+  completed.insert(chunk);
+  stats.bytes = completed.size();
+  checksum.advance();
+
+  // Reports may walk every active connection, so don't make one on every read
+  if(now - last_progress < 100 && stats.bytes != file_size) {
+    return;
+  }
+  last_progress = now;
+  if(on_progress) {
+    on_progress(*this);
+  }
 }
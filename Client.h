@@ -4,6 +4,9 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
 #include <cassert>
 
 #include <arpa/inet.h>
@@ -11,7 +14,13 @@
 #include <ares.h>
 #include <uv.h>
 
+#include "Checksum.h"
 #include "Connection.h"
+#include "Control.h"
+#include "Http2.h"
+#include "Metrics.h"
+#include "Mirror.h"
+#include "Tls.h"
 
 struct Client {
   class Ares {
@@ -49,53 +58,247 @@ struct Client {
   struct AresPoll {
     uv_poll_t handle;
     int fd;
-    ares_channel channel;
-  };
-
-  struct Resolution {
-    const std::string req_host;
-    const std::string host;
-    const in_port_t port;
-    const std::string path;
     Client &client;
   };
 
-  Client() {
-    uv_loop_init(&loop);
-    uv_timer_init(&loop, &ares_timer);
-    ares_timer.data = this;
-  }
-
+  // Runs on the given loop, or on a private one when it's null. It may be
+  // constructed and configured on any thread, but once start() or
+  // start_thread() is called only the loop's thread may touch it, apart
+  // from cancel() and join().
+  explicit Client(uv_loop_t *external = nullptr);
+  // Only once on_done has been called, or if start() was never called
   ~Client();
 
+  // Embedding interface. Configure the public settings below, add URLs,
+  // then either start() and run the loop, or start_thread(). on_progress
+  // and on_done are called on the loop's thread. Once start() has been
+  // called, the loop must run until on_done even if start() failed.
+  bool add_url(const char *url);
+  // Returns nullptr on success, or a description of the failure
+  const char *start();
+  void start_thread();
+  void join();
+  // Safe to call from any thread; on_done follows with an error
+  void cancel();
+
+  // Called at most every 100 ms while data arrives, and once at the end
+  std::function<void(Client &)> on_progress;
+  // Called once every handle is closed; error is null on success
+  std::function<void(Client &, const char *error)> on_done;
+
+  // Creates the client's own handles on the loop, once start() commits to running
+  void init_handles();
   void ares_stage();
+  void ares_close(AresPoll *poll);
 
   void init_file();
+  // Sizes and maps the output for ranged downloading
+  bool prepare_output();
+  // Copies blocks found in seed_file into the output so they aren't fetched
+  void apply_seed();
+  void fill_from_cache();
+  // Runs on the threadpool, keeping cache_ranges of the output
+  void store_in_cache();
+  // A stream learned the size and that ranges work; false if that failed
+  bool go_parallel(uint64_t size);
+  // Writes stream data at off, growing the output; false if that failed
+  bool write_stream(uint64_t off, const char *data, size_t len);
+  void end_stream(uint64_t size);
+  // Whether any other live connection's mirror honours ranges
+  bool ranges_elsewhere(const Connection &conn) const;
 
-  void open(std::string req_host, std::string host, in_port_t port, std::string path);
+  void open(std::string req_host, std::string host, in_port_t port, std::string path, bool tls);
+  void resolve(Mirror &mirror);
+  // Ends the download, closing every connection; an empty reason is success
+  void finish(std::string reason);
+  void maybe_done();
+  void handle_closed();
+  // Checks a successful download's checksum and updates the cache to
+  // match, then syncs the output and moves it into place; failures become
+  // the download's error
+  void finalize();
 
-  void progress(uint64_t bytes);
+  Connection &create_connection(Mirror &mirror, std::string host, std::string path, std::string server_name);
+  // Opens an HTTP/2 session carrying streams_per_session connections
+  Http2Session &open_session(Mirror &res);
+  void transition(Connection &conn, Connection::State from, Connection::State to);
+  void recycle(Connection &conn);
+  const std::vector<Connection *> &in_state(Connection::State state) const {
+    return by_state[static_cast<size_t>(state)];
+  }
 
-  void balance_chunks();
+  void progress(Chunk chunk);
+
+  // Makes a chunk of the file writable through conn.mapping
+  bool map_window(Connection &conn, Chunk chunk);
+  void unmap_window(Connection &conn);
+
+  Chunk take_chunk();
+  void release(Chunk claim, Chunk leftover);
   void schedule_work();
+  // Schedules from the loop rather than the current callback
+  void defer_schedule();
+  // Ranks probed mirrors and holds all but the best mirror_limit in
+  // standby; false while probes are still outstanding
+  bool select_mirrors();
+  // Called when a mirror fails or loses its last connection
+  void mirror_lost(Mirror &mirror);
+  // Called when a mirror's last connection is closed by the server for
+  // idleness; the mirror keeps its address and reconnects when wanted
+  void mirror_dormant(Mirror &mirror);
+  // Opens a connection, or an HTTP/2 session, to a resolved mirror
+  void reconnect(Mirror &mirror);
+  void autotune();
+  // Adjusts scale_target from the throughput and failures since the last call
+  void autoscale();
+  // Opens another connection to an already-resolved mirror
+  void add_connection(Mirror &mirror);
+  // Brings every usable mirror up to scale_target connections
+  void grow_connections();
+
+  // Runtime adjustments, as made through the control socket
+  // Closes the mirror's connections and stops using it, as if it had failed
+  void remove_mirror(Mirror &mirror);
+  // Bytes per second; 0 removes the limit
+  void set_rate_limit(uint64_t limit);
+  // Fixes the connections per mirror, taking over from autoscaling
+  void set_connection_target(unsigned target);
+  void set_paused(bool pause);
+  // Charges received bytes against the rate limit
+  void account_read(size_t bytes);
+  // Starts or stops every socket's reads to match paused and the rate limit
+  void update_reading();
 
-  uv_loop_t loop;
+  uv_loop_t own_loop;
+  uv_loop_t *loop;
+  std::thread thread;
 
   Ares ares;
   Ares::Channel dns;
+  Tls tls;
+  const char *ca_file = nullptr;
   uv_timer_t ares_timer;
-  std::vector<AresPoll> ares_polls;
+  uv_timer_t autotune_timer;
+  uv_timer_t mirror_timer;
+  uv_timer_t scale_timer;
+  uv_timer_t rate_timer;
+  uv_check_t loop_check;
+  uint64_t last_check = 0;
+  uv_async_t cancel_async;
+  bool handles_ready = false;
+  // Guards cancel_async against cancel() from other threads
+  std::mutex cancel_mutex;
+  bool cancel_requested = false;
+  bool cancel_open = false;
+  std::vector<AresPoll *> ares_polls;
 
-  std::deque<Resolution> resolutions;
+  bool started = false;
+  bool finished = false;
+  bool finalized = false;
+  bool reported = false;
+  std::string error;
+  // Client-owned handles whose close callbacks are outstanding
+  unsigned closing_handles = 0;
+  unsigned live_sessions = 0;
+  std::vector<Http2Session *> sessions;
+
+  std::deque<Mirror> mirrors;
+  // Mirrors to download from at once; 0 uses every mirror without probing
+  unsigned mirror_limit = 0;
+  bool probing = false;
+  uint64_t probe_start = 0;
+  // Slab of connection storage; closed connections are recycled through
+  // free_connections rather than released, so pointers stay valid.
   std::deque<Connection> connections;
-  std::vector<Chunk> chunks;
+  std::vector<Connection *> free_connections;
+  std::vector<Connection *> by_state[Connection::STATE_COUNT];
+
+  // Every byte of the file is pending or in flight until it's completed.
+  // In-flight ranges are those claimed by a connection's outstanding
+  // request, and may already be partially completed.
+  IntervalSet pending;
+  IntervalSet in_flight;
+  IntervalSet completed;
+
+  // Prior-knowledge HTTP/2 for plain http:// URLs
+  bool http2 = false;
+  unsigned streams_per_session = 8;
 
+  // Destination: a new file at file_name, a caller-owned descriptor, or a
+  // caller-owned buffer of at least the file's size. A new file is written
+  // as part_name and only renamed to file_name once complete and verified;
+  // it's removed if the download fails.
   const char *file_name = nullptr;
+  std::string part_name;
+  int output_fd = -1;
+  uint8_t *output_buffer = nullptr;
+  size_t output_capacity = 0;
+  bool output_ready = false;
   const char *user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0";
+  // Milliseconds; 0 disables
+  uint64_t connect_timeout = 10000;
+  uint64_t header_timeout = 30000;
+  uint64_t idle_timeout = 30000;
   uint64_t file_size = ~0;
+  // No mirror has given a size, so one connection at a time fetches the
+  // whole file sequentially
+  bool streaming = false;
   int fd = -1;
+  // The whole-file mapping; null when connections map their own windows
   uint8_t *file_data = nullptr;
+  // Bytes; 0 maps the whole file up front
+  uint64_t window_size = 0;
+  // Prefault mappings and ask for transparent huge pages
+  bool populate = false;
+  // Receive plain HTTP/1.1 bodies with splice(2) instead of through the mapping
+  bool splice = false;
+  // Delta download: a previous version of the file and the new version's
+  // .zsync block map
+  const char *seed_file = nullptr;
+  const char *block_map_file = nullptr;
+  // Piece cache shared across runs; null disables it
+  const char *cache_dir = nullptr;
+  uint64_t cache_limit = 1024ULL * 1024 * 1024;
+  // Empty until a mirror gives a validator for the file
+  std::string cache_key;
+  uint64_t cache_supplied = 0;
+  uv_work_t cache_work;
+  IntervalSet cache_ranges;
+  bool cache_busy = false;
+  // Size socket buffers from measured bandwidth-delay products
+  bool autotune_sockets = true;
+  uint64_t last_autotune = 0;
+  // Connections per mirror grow from one, doubling while throughput keeps
+  // improving, then hold with an occasional probe for one more. Failures or
+  // a slump halve them. 0 disables; otherwise the most per mirror.
+  unsigned autoscale_max = 0;
+  unsigned scale_target = 1;
+  bool scale_slow_start = true;
+  unsigned scale_steady = 0;
+  // Throughput before the current probe for one more connection, if any
+  uint64_t scale_probe_base = 0;
+  uint64_t scale_bytes = 0;
+  uint64_t scale_rate = 0;
+  uint64_t failures = 0;
+  uint64_t scale_failures = 0;
+  // Token bucket refilled every RATE_TICK; reads stop while it's empty, and
+  // a read larger than what's left runs it into debt
+  uint64_t rate_limit = 0;
+  int64_t rate_tokens = 0;
+  uint64_t last_refill = 0;
+  bool paused = false;
+  // Whether sockets are being read, per paused and the rate limit
+  bool reading = true;
+  // "algo:hex" or "tree-algo:hex" to verify the file against; null disables
+  // it. The output is read back, so an output_fd must be readable.
+  const char *checksum_spec = nullptr;
+  Checksum checksum{*this};
+  // Unix-domain socket for runtime commands; null disables it
+  const char *control_path = nullptr;
+  Control control{*this};
   Stats stats;
+  Metrics metrics;
+  uint64_t last_progress = 0;
 };
 
 #endif
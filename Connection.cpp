@@ -1,30 +1,145 @@
 #include "Connection.h"
 
-#include <sstream>
-
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <strings.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <openssl/err.h>
 #include <cstdio>
 
 #include "Client.h"
+#include "Http2.h"
 #include "Util.h"
-#include "Url.h"
 
 namespace {
+// Appends to a fixed buffer, returning false if it had to truncate
+bool append(char *buffer, size_t &len, size_t capacity, const char *at, size_t length) {
+  // Keep room for a terminator
+  bool fits = len + length < capacity;
+  if(!fits) {
+    length = capacity - 1 - len;
+  }
+  memcpy(buffer + len, at, length);
+  len += length;
+  buffer[len] = '\0';
+  return fits;
+}
+
+const size_t MIN_READ_SIZE = 64 * 1024;
+const uint64_t MAX_RCVBUF = 64 * 1024 * 1024;
+const size_t MIN_HEADER_BUFFER = 4 * 1024;
+// For bodies that have to pass through the parser: streams, chunked and skipped
+const size_t COPY_BUFFER = 256 * 1024;
+// Milliseconds between timeout checks while reads are stopped
+const uint64_t STALL_RECHECK = 1000;
+
+// The most SO_RCVBUF may ask for without CAP_NET_ADMIN; 0 if unknown
+uint64_t rmem_max() {
+  static uint64_t value = [] {
+    unsigned long long max = 0;
+    FILE *file = fopen("/proc/sys/net/core/rmem_max", "r");
+    if(file != nullptr) {
+      if(fscanf(file, "%llu", &max) != 1) {
+        max = 0;
+      }
+      fclose(file);
+    }
+    return static_cast<uint64_t>(max);
+  }();
+  return value;
+}
+
+// Advances matched, the length of "\r\n\r\n" that the bytes so far end
+// with, over data; returns the length up to the end of the blank line, or
+// len if it isn't there
+size_t find_blank_line(uint8_t &matched, const char *data, size_t len) {
+  static const char terminator[] = "\r\n\r\n";
+  for(size_t i = 0; i < len; ++i) {
+    if(data[i] == terminator[matched]) {
+      if(++matched == 4) {
+        return i + 1;
+      }
+    } else {
+      matched = data[i] == '\r' ? 1 : 0;
+    }
+  }
+  return len;
+}
+
+// Shortens a read so it stops at the end of the response headers, letting
+// the body that follows go straight to the output. Peeking costs a syscall
+// per response rather than a copy of whatever body shared the headers' read.
+size_t header_read_len(Connection &connection, char *base, size_t len) {
+  ssize_t peeked;
+  if(connection.ssl != nullptr) {
+    peeked = SSL_peek(connection.ssl, base, len);
+  } else {
+    peeked = recv(connection.handle.io_watcher.fd, base, len, MSG_PEEK | MSG_DONTWAIT);
+  }
+  if(peeked <= 0) {
+    // Let the real read report whatever this is
+    return len;
+  }
+  // The blank line may have begun at the end of the last read
+  uint8_t matched = connection.header_tail;
+  size_t found = find_blank_line(matched, base, peeked);
+  return matched == 4 ? found : len;
+}
+
+// Where the next plaintext belongs: straight into the output once a
+// response body is underway, otherwise the connection's own buffer
+uv_buf_t destination(Connection &connection) {
+  // Chunk framing and skipped bytes have to pass through the parser first
+  if(connection.state == Connection::State::GET_COPY && connection.skip == 0 &&
+     !(connection.parser.flags & F_CHUNKED))
+    connection.set_state(Connection::State::GET_DIRECT);
+
+  uv_buf_t buf;
+  if(connection.state == Connection::State::GET_DIRECT && connection.begin != connection.end) {
+    buf.base = reinterpret_cast<char *>(connection.begin);
+    buf.len = connection.end - connection.begin;
+  } else {
+    bool body = connection.state == Connection::State::GET_COPY ||
+      connection.state == Connection::State::GET_DIRECT || connection.state == Connection::State::GET_STREAM;
+    // Headers rarely change length between responses from one server
+    size_t len = body ? COPY_BUFFER : std::max(MIN_HEADER_BUFFER, 2 * connection.header_len);
+    if(connection.buffer.size() < len) {
+      connection.buffer.resize(len);
+    }
+    buf.base = connection.buffer.data();
+    buf.len = len;
+    if(connection.state == Connection::State::GET_HEADERS) {
+      buf.len = header_read_len(connection, buf.base, buf.len);
+    }
+  }
+  if(connection.read_size != 0 && buf.len > connection.read_size) {
+    buf.len = connection.read_size;
+  }
+  return buf;
+}
+
 void alloc_cb(uv_handle_t* handle,
               size_t suggested_size,
               uv_buf_t* buf) {
   (void)suggested_size;
   auto &connection = *reinterpret_cast<Connection *>(handle);
-  if(connection.state == Connection::State::GET_COPY)
-    connection.state = Connection::State::GET_DIRECT;
-
-  if(connection.state == Connection::State::GET_DIRECT) {
-    buf->base = reinterpret_cast<char *>(connection.begin);
-    buf->len = connection.end - connection.begin;
+  if(connection.ssl != nullptr) {
+    buf->base = connection.tls_buffer.data();
+    buf->len = connection.tls_buffer.size();
   } else {
-    static char buffer[1024 * 1024];
-    buf->base = buffer;
-    buf->len = elementsof(buffer);
+    *buf = destination(connection);
+    if(connection.state == Connection::State::GET_DIRECT &&
+       ++connection.fault_sample % Metrics::FAULT_SAMPLE == 0) {
+      struct rusage usage;
+      getrusage(RUSAGE_THREAD, &usage);
+      connection.fault_mark = usage.ru_minflt;
+    }
   }
 }
 
@@ -32,126 +147,162 @@ void write_cb(uv_write_t* req, int status);
 
 int message_complete_cb(http_parser *parser) {
   auto &connection = *reinterpret_cast<Connection *>(parser->data);
-  if((connection.state == Connection::State::HEAD && parser->status_code != 200) ||
-     ((connection.state == Connection::State::GET_HEADERS ||
-       connection.state == Connection::State::GET_COPY ||
-       connection.state == Connection::State::GET_DIRECT)
-      && parser->status_code != 206)) {
-    fprintf(stderr, "WARN: Abandoning connection to %s due to HTTP %u %s\n", connection.host.c_str(), parser->status_code, connection.status.c_str());
-    connection.state = Connection::State::FAILED;
-    connection.close();
-    return 0;
-  }
+  return connection.on_message_complete(parser->status_code);
+}
 
-  connection.state = Connection::State::IDLE;
+int headers_complete_cb(http_parser *parser) {
+  auto &connection = *reinterpret_cast<Connection *>(parser->data);
+  connection.header_len = parser->nread;
+  // A chunked body's length is only known once it ends
+  return connection.on_headers_complete(parser->status_code,
+                                        parser->flags & F_CHUNKED ? ~0ULL : parser->content_length);
+}
 
-  return 1;
+int status_cb(http_parser *parser, const char *at, size_t length) {
+  auto &connection = *reinterpret_cast<Connection *>(parser->data);
+  append(connection.status, connection.status_len, Connection::STATUS_MAX, at, length);
+  return 0;
 }
 
-int headers_complete_cb(http_parser *parser) {
+int body_cb(http_parser *parser, const char *at, size_t length) {
   auto &connection = *reinterpret_cast<Connection *>(parser->data);
+  ScopedTimer timer(connection.client.metrics.body_ns);
+  return connection.on_body(at, length);
+}
 
-  if(!connection.header_name.empty()) {
-    connection.process_header(connection.header_name, connection.header_value);
-    connection.header_name.clear();
-    connection.header_value.clear();
+int header_field_cb(http_parser *parser, const char *at, size_t length) {
+  auto &connection = *reinterpret_cast<Connection *>(parser->data);
+  if(connection.header_in_value) {
+    connection.process_header(parser->status_code);
+  }
+  if(!append(connection.header_name, connection.header_name_len, Connection::HEADER_NAME_MAX, at, length)) {
+    connection.header_truncated = true;
   }
+  return 0;
+}
 
-  if(!connection.redirect.empty()) {
-    connection.close();
+int header_value_cb(http_parser *parser, const char *at, size_t length) {
+  auto &connection = *reinterpret_cast<Connection *>(parser->data);
+  connection.header_in_value = true;
+  if(!append(connection.header_value, connection.header_value_len, Connection::HEADER_VALUE_MAX, at, length)) {
+    connection.header_truncated = true;
+  }
+  return 0;
+}
 
-    Url url(connection.redirect.c_str());
+http_parser_settings make_settings() {
+  http_parser_settings settings{};
+  settings.on_status = status_cb;
+  settings.on_message_complete = message_complete_cb;
+  settings.on_headers_complete = headers_complete_cb;
+  settings.on_header_field = header_field_cb;
+  settings.on_header_value = header_value_cb;
+  settings.on_body = body_cb;
+  return settings;
+}
 
-    if(url.scheme.base != nullptr &&
-       url.scheme.len != 4 &&
-       0 != strncmp(url.scheme.base, "http", url.scheme.len)) {
-      fprintf(stderr, "WARN: Ignoring redirect URL with non-http scheme %s\n", std::string(url.scheme.base, url.scheme.len).c_str());
-      return 0;
-    }
+const http_parser_settings settings = make_settings();
 
-    if(url.host.base == nullptr || url.host.len == 0) {
-      fprintf(stderr, "WARN: Ignoring redirect URL with no host component\n(did you forget the leading \"//\"?)\n");
-      return 0;
-    }
+void parse(Connection &connection, const char *data, ssize_t nread) {
+  if(connection.state == Connection::State::GET_COPY || connection.state == Connection::State::GET_DIRECT ||
+     connection.state == Connection::State::GET_STREAM) {
+    connection.extend_timeout(connection.client.idle_timeout);
+  }
 
-    const in_port_t port = url.port.base == nullptr ? 80 : strtol(url.port.base, nullptr, 10);
-    if(port == 0) {
-      fprintf(stderr, "WARN: Ignoring redirect URL with invalid port: %s\n", std::string(url.port.base, url.port.len).c_str());
-      return 0;
+  if(connection.state == Connection::State::GET_HEADERS && nread > 0) {
+    // Only the last few bytes can start the blank line
+    size_t tail = std::min<size_t>(nread, 3);
+    if(static_cast<size_t>(nread) > tail) {
+      connection.header_tail = 0;
+    }
+    if(find_blank_line(connection.header_tail, data + nread - tail, tail) != tail ||
+       connection.header_tail == 4) {
+      connection.header_tail = 0;
     }
-
-    std::string path = url.path.base != nullptr ? std::string(url.path.base, url.path.len) : "/";
-    connection.client.open(std::string(url.host.base, url.host.len) + (url.port.base ? ":" + std::string(url.port.base, url.port.len) : ""),
-                           std::string(url.host.base, url.host.len),
-                           port,
-                           std::move(path));
-
-    return 0;
   }
 
-  if(connection.state == Connection::State::GET_HEADERS) {
-    connection.state = Connection::State::GET_COPY;
+  size_t parsed;
+  {
+    ScopedTimer timer(connection.client.metrics.parse_ns);
+    parsed = http_parser_execute(&connection.parser, &settings, data, nread == UV__EOF ? 0 : nread);
+  }
+  auto http_errno = HTTP_PARSER_ERRNO(&connection.parser);
+  if(http_errno == HPE_CB_message_complete) {
+    connection.status_len = 0;
+    http_parser_init(&connection.parser, HTTP_RESPONSE);
+    connection.client.schedule_work();
   }
-  connection.stats.start_time = uv_now(&connection.client.loop);
-  connection.stats.bytes = 0;
 
-  if(connection.state != Connection::State::HEAD) {
-    return 0;
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&connection.handle))) {
+    // A callback has already dealt with the connection
+    return;
   }
 
-  if(parser->content_length != 0) {
-    if(connection.head(parser->content_length)) {
-      fprintf(stderr, "WARN: %s served file of %lu bytes, expected %lu bytes\n", connection.host.c_str(), parser->content_length,
-              connection.client.file_size);
-      connection.state = Connection::State::FAILED;
-      connection.close();
-    }
-  } else {
-    fprintf(stderr, "WARN: Failed to parse Content-Length header\n");
+  if(nread == UV__EOF) {
+    // A body delimited by the connection closing has completed above
+    connection.idle_closed = connection.idle();
+    connection.set_state(Connection::State::COMPLETE);
+    connection.close();
+    return;
+  }
+  if(parsed != static_cast<size_t>(nread)) {
+    assert(http_errno != HPE_CB_message_complete);
+    fprintf(stderr, "WARN: HTTP parse error: %s: %s\n", http_errno_name(http_errno), http_errno_description(http_errno));
+    connection.set_state(Connection::State::FAILED);
+    connection.close();
   }
 
-  return 1;
+  if(connection.state == Connection::State::GET_COPY && connection.client.splice) {
+    connection.start_splice();
+  }
 }
 
-int status_cb(http_parser *parser, const char *at, size_t length) {
-  auto &connection = *reinterpret_cast<Connection *>(parser->data);
-  connection.status += std::string(at, length);
-  return 0;
+void fail_tls(Connection &connection, const char *what, int result) {
+  int error = SSL_get_error(connection.ssl, result);
+  long verify = SSL_get_verify_result(connection.ssl);
+  if(verify != X509_V_OK) {
+    fprintf(stderr, "WARN: TLS %s with %s failed: %s\n", what, connection.host.c_str(), X509_verify_cert_error_string(verify));
+  } else if(error == SSL_ERROR_SSL) {
+    fprintf(stderr, "WARN: TLS %s with %s failed: %s\n", what, connection.host.c_str(), ERR_reason_error_string(ERR_get_error()));
+  } else {
+    fprintf(stderr, "WARN: TLS %s with %s failed (error %d)\n", what, connection.host.c_str(), error);
+  }
+  ERR_clear_error();
+  connection.set_state(Connection::State::FAILED);
+  connection.close();
 }
 
-int body_cb(http_parser *parser, const char *at, size_t length) {
-  auto &connection = *reinterpret_cast<Connection *>(parser->data);
-
-  if(connection.begin + length > connection.end) {
-    fprintf(stderr, "WARN: Server tried to overflow output\n");
-    return 1;
+void read_tls(Connection &connection, ssize_t nread, const uv_buf_t *buf) {
+  if(nread == UV__EOF) {
+    parse(connection, nullptr, nread);
+    return;
   }
 
-  if(connection.state == Connection::State::GET_COPY) {
-    memcpy(connection.begin, at, length);
+  BIO_write(connection.tls_in, buf->base, nread);
+  if(!connection.tls_pump()) {
+    return;
   }
-  connection.begin += length;
-  connection.stats.bytes += length;
-  connection.client.progress(length);
-
-  return 0;
-}
 
-int header_field_cb(http_parser *parser, const char *at, size_t length) {
-  auto &connection = *reinterpret_cast<Connection *>(parser->data);
-  if(!connection.header_value.empty()) {
-    connection.process_header(connection.header_name, connection.header_value);
-    connection.header_name.clear();
-    connection.header_value.clear();
+  // Decrypt straight into the output wherever the body is headed
+  while(!uv_is_closing(reinterpret_cast<uv_handle_t *>(&connection.handle))) {
+    auto dest = destination(connection);
+    int result = SSL_read(connection.ssl, dest.base, dest.len);
+    if(result <= 0) {
+      int error = SSL_get_error(connection.ssl, result);
+      if(error == SSL_ERROR_ZERO_RETURN) {
+        parse(connection, nullptr, UV__EOF);
+      } else if(error != SSL_ERROR_WANT_READ) {
+        fail_tls(connection, "read", result);
+      }
+      break;
+    }
+    parse(connection, dest.base, result);
   }
-  connection.header_name += std::string(at, length);
-  return 0;
-}
 
-int header_value_cb(http_parser *parser, const char *at, size_t length) {
-  auto &connection = *reinterpret_cast<Connection *>(parser->data);
-  connection.header_value += std::string(at, length);
-  return 0;
+  if(!uv_is_closing(reinterpret_cast<uv_handle_t *>(&connection.handle))) {
+    // Post-handshake messages may call for a reply
+    connection.tls_pump();
+  }
 }
 
 void read_cb(uv_stream_t* stream,
@@ -160,92 +311,211 @@ void read_cb(uv_stream_t* stream,
   auto &connection = *reinterpret_cast<Connection *>(stream);
 
   if(nread < 0 && nread != UV__EOF) {
+    if(connection.idle()) {
+      // Some servers reset rather than close an idle connection
+      connection.idle_closed = true;
+      connection.set_state(Connection::State::COMPLETE);
+      connection.close();
+      return;
+    }
     fprintf(stderr, "WARN: Closing connection to %s due to read error: %s\n", connection.host.c_str(),
             uv_strerror(nread));
-    connection.state = Connection::State::FAILED;
+    connection.set_state(Connection::State::FAILED);
     connection.close();
     return;
   }
 
-  http_parser_settings settings{};
-  settings.on_status = status_cb;
-  settings.on_message_complete = message_complete_cb;
-  settings.on_headers_complete = headers_complete_cb;
-  settings.on_header_field = header_field_cb;
-  settings.on_header_value = header_value_cb;
-  settings.on_body = body_cb;
-  auto parsed = http_parser_execute(&connection.parser, &settings, buf->base, nread == UV__EOF ? 0 : nread);
-  auto http_errno = HTTP_PARSER_ERRNO(&connection.parser);
-  if(http_errno == HPE_CB_message_complete) {
-    connection.status = "";
-    http_parser_init(&connection.parser, HTTP_RESPONSE);
-    connection.client.schedule_work();
+  if(nread > 0) {
+    connection.client.metrics.read_bytes.record(nread);
+    connection.client.account_read(nread);
+  }
+  if(connection.fault_mark >= 0) {
+    // Faults taken while the kernel copied into the mapping
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    connection.client.metrics.direct_faults.record(usage.ru_minflt - connection.fault_mark);
+    connection.fault_mark = -1;
   }
 
-  if(parsed != static_cast<size_t>(nread)) {
-    switch(http_errno) {
-    case HPE_CB_message_complete:
-      assert(false);
-
-    default:
-      if(nread == UV__EOF) {
-        assert(parsed == 0);
-        connection.state = Connection::State::COMPLETE;
-      } else {
-        fprintf(stderr, "WARN: HTTP parse error: %s: %s\n", http_errno_name(http_errno), http_errno_description(http_errno));
-        connection.state = Connection::State::FAILED;
-      }
-      connection.close();
-    }
+  if(connection.ssl != nullptr) {
+    read_tls(connection, nread, buf);
+  } else {
+    parse(connection, buf->base, nread);
   }
 }
 
+
 void write_cb(uv_write_t* req, int status) {
   auto &connection = *reinterpret_cast<Connection *>(req->data);
+  if(status == UV_ECANCELED) {
+    return;
+  }
   if(status < 0) {
     fprintf(stderr, "WARN: Failed to send HTTP request to %s: %s\n", connection.host.c_str(), uv_strerror(status));
-    connection.state = Connection::State::FAILED;
+    connection.set_state(Connection::State::FAILED);
     connection.close();
     return;
   }
 }
 
+void tls_write_cb(uv_write_t *req, int status) {
+  auto &connection = *reinterpret_cast<Connection *>(req->data);
+  connection.tls_writing = false;
+  write_cb(req, status);
+  if(status == 0 && !uv_is_closing(reinterpret_cast<uv_handle_t *>(&connection.handle))) {
+    // Flush whatever was produced while this write was out
+    connection.tls_pump();
+  }
+}
+
 void connect_cb(uv_connect_t *req, int status) {
   auto &connection = *reinterpret_cast<Connection *>(req->data);
 
+  if(status == UV_ECANCELED) {
+    return;
+  }
   if(status < 0) {
     fprintf(stderr, "WARN: Connection to %s failed: %s\n", connection.host.c_str(), uv_strerror(status));
-    connection.state = Connection::State::FAILED;
+    connection.set_state(Connection::State::FAILED);
     connection.close();
     return;
   }
 
-  connection.state = Connection::State::HEAD;
+  connection.connect_rtt = uv_now(connection.client.loop) - connection.connect_start;
+  connection.set_state(Connection::State::HEAD);
+  connection.set_timeout(connection.client.header_timeout);
 
-  uv_buf_t bufs[7];
-  bufs[0].base = const_cast<char *>("HEAD ");
-  bufs[0].len = strlen(bufs[0].base);
-  bufs[1].base = const_cast<char *>(connection.path.data());
-  bufs[1].len = connection.path.size();
-  bufs[2].base = const_cast<char *>(" HTTP/1.1\r\nHost: ");
-  bufs[2].len = strlen(bufs[2].base);
-  bufs[3].base = const_cast<char *>(connection.host.data());
-  bufs[3].len = connection.host.size();
-  bufs[4].base = const_cast<char *>("\r\nUser-Agent: ");
-  bufs[4].len = strlen(bufs[4].base);
-  bufs[5].base = const_cast<char *>(connection.client.user_agent);
-  bufs[5].len = strlen(bufs[5].base);
-  bufs[6].base = const_cast<char *>("\r\nConnection: keep-alive\r\n\r\n");
-  bufs[6].len = strlen(bufs[6].base);
+  connection.request_template = " " + connection.path + " HTTP/1.1\r\n"
+    "Host: " + connection.host + "\r\n"
+    "User-Agent: " + connection.client.user_agent + "\r\n"
+    "Connection: keep-alive\r\n";
 
-  uv_write(&connection.write_req, reinterpret_cast<uv_stream_t *>(&connection.handle), bufs, elementsof(bufs), write_cb);
-  uv_read_start(reinterpret_cast<uv_stream_t *>(&connection.handle), alloc_cb, read_cb);
+  if(!connection.server_name.empty()) {
+    connection.tls_parked = connection.client.tls.park(connection);
+    if(!connection.tls_parked) {
+      connection.start_tls();
+    }
+    return;
+  }
+
+  connection.receiving = true;
+  connection.watch();
+  connection.send_head();
+}
+
+void splice_cb(uv_poll_t *handle, int status, int events) {
+  (void)events;
+  auto &connection = *reinterpret_cast<Connection *>(handle->data);
+  if(status < 0) {
+    fprintf(stderr, "WARN: Closing connection to %s due to poll error: %s\n", connection.host.c_str(), uv_strerror(status));
+    connection.set_state(Connection::State::FAILED);
+    connection.close();
+    return;
+  }
+
+  while(connection.begin != connection.end) {
+    ssize_t moved = splice(connection.splice_fd, nullptr, connection.splice_pipe[1], nullptr,
+                           connection.end - connection.begin, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(moved < 0 && errno == EAGAIN) {
+      return;
+    }
+    if(moved <= 0) {
+      fprintf(stderr, "WARN: Closing connection to %s due to read error: %s\n", connection.host.c_str(),
+              moved == 0 ? "connection closed" : strerror(errno));
+      connection.set_state(Connection::State::FAILED);
+      connection.close();
+      return;
+    }
+    connection.client.metrics.read_bytes.record(moved);
+    connection.client.account_read(moved);
+
+    // The pipe already holds these bytes, so draining it can't stall on the socket
+    loff_t off = connection.file_offset(connection.begin);
+    for(ssize_t left = moved; left > 0;) {
+      ssize_t written = splice(connection.splice_pipe[0], nullptr, connection.client.fd, &off, left, SPLICE_F_MOVE);
+      if(written < 0) {
+        connection.client.finish(std::string("Failed to write output: ") + strerror(errno));
+        return;
+      }
+      left -= written;
+    }
+
+    connection.extend_timeout(connection.client.idle_timeout);
+    connection.begin += moved;
+    connection.stats.bytes += moved;
+    connection.stats.received += moved;
+    connection.client.progress(Chunk{connection.file_offset(connection.begin) - moved, static_cast<size_t>(moved)});
+    if(!connection.client.reading && connection.begin != connection.end) {
+      // Throttled; watch() has stopped the poll until reads resume
+      return;
+    }
+  }
+
+  // Body is complete; hand the socket back to libuv for the next response
+  uv_poll_stop(&connection.splice_poll);
+  connection.splicing = false;
+  connection.watch();
+  connection.on_message_complete(connection.parser.status_code);
+  connection.status_len = 0;
+  http_parser_init(&connection.parser, HTTP_RESPONSE);
+  connection.client.schedule_work();
+}
+
+void close_cb(uv_handle_t *handle) {
+  auto &connection = *reinterpret_cast<Connection *>(handle->data);
+  if(--connection.pending_closes == 0) {
+    if(connection.ssl != nullptr) {
+      SSL_free(connection.ssl);
+      connection.ssl = nullptr;
+    }
+    connection.client.recycle(connection);
+  }
+}
+
+void timeout_cb(uv_timer_t *timer) {
+  auto &connection = *reinterpret_cast<Connection *>(timer->data);
+  auto now = uv_now(connection.client.loop);
+  if(now < connection.deadline) {
+    // Deadline was pushed back by activity since the timer was armed
+    uv_timer_start(&connection.timer, timeout_cb, connection.deadline - now, 0);
+    return;
+  }
+  if(!connection.client.reading && connection.state != Connection::State::CONNECT) {
+    // Paused or rate limited; resuming pushes the deadline back
+    uv_timer_start(&connection.timer, timeout_cb, STALL_RECHECK, 0);
+    return;
+  }
+
+  const char *phase;
+  switch(connection.state) {
+  case Connection::State::CONNECT:
+    phase = "connecting";
+    break;
+  case Connection::State::HEAD:
+  case Connection::State::GET_HEADERS:
+    phase = "waiting for response headers";
+    break;
+  default:
+    phase = "receiving data";
+    break;
+  }
+  fprintf(stderr, "WARN: Connection to %s timed out while %s\n", connection.host.c_str(), phase);
+  connection.set_state(Connection::State::FAILED);
+  connection.close();
+  if(connection.client.output_ready) {
+    // Hand the released range to another connection immediately
+    connection.client.schedule_work();
+  }
 }
 }
 
 bool Connection::head(uint64_t size) {
   if(client.file_size == ~0ULL) {
-    client.file_size = size;
+    if(!client.output_ready) {
+      // A known size beats streaming from a mirror that didn't give one
+      client.file_size = size;
+      client.streaming = false;
+    }
     return false;
   }
 
@@ -262,6 +532,8 @@ void Connection::connect(in_addr ip, in_port_t port) {
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
   addr.sin_addr = ip;
+  set_timeout(client.connect_timeout);
+  connect_start = uv_now(client.loop);
   uv_tcp_connect(&connect_req, &handle, reinterpret_cast<struct sockaddr *>(&addr), connect_cb);
 }
 
@@ -271,56 +543,681 @@ void Connection::connect(in6_addr ip, in_port_t port) {
   addr.sin6_family = AF_INET6;
   addr.sin6_port = htons(port);
   addr.sin6_addr = ip;
+  set_timeout(client.connect_timeout);
+  connect_start = uv_now(client.loop);
   uv_tcp_connect(&connect_req, &handle, reinterpret_cast<struct sockaddr *>(&addr), connect_cb);
 }
 
 void Connection::close() {
-  uv_close(reinterpret_cast<uv_handle_t *>(&handle), nullptr);
-  if(begin != nullptr && begin != end) {
-    client.chunks.push_back(Chunk{static_cast<size_t>(begin - client.file_data), static_cast<size_t>(end - begin)});
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+  if(session != nullptr) {
+    session->detach(*this);
+  }
+  if(tls_parked) {
+    client.tls.unpark(*this);
+    tls_parked = false;
+  } else if(!server_name.empty()) {
+    client.tls.release(*this);
+  }
+  pending_closes = 2;
+  uv_close(reinterpret_cast<uv_handle_t *>(&handle), close_cb);
+  uv_close(reinterpret_cast<uv_handle_t *>(&timer), close_cb);
+  if(splice_fd != -1) {
+    ++pending_closes;
+    uv_close(reinterpret_cast<uv_handle_t *>(&splice_poll), close_cb);
+    ::close(splice_fd);
+    ::close(splice_pipe[0]);
+    ::close(splice_pipe[1]);
+    splice_fd = splice_pipe[0] = splice_pipe[1] = -1;
+  }
+  if(rival != nullptr) {
+    // The surviving rival still covers our range
+    if(scratch_dest == nullptr) {
+      rival->scratch_from = rival->mapped(file_offset(begin));
+      rival->range = range;
+      range = Chunk{0, 0};
+    }
+    rival->rival = nullptr;
+    rival = nullptr;
+  } else if(scratch_dest != nullptr) {
+    // Orphaned duplicate: keep what arrived and release the rest
+    uint8_t *received = scratch_dest + (begin - scratch.data());
+    uint8_t *dest_end = scratch_dest + scratch.size();
+    if(received > scratch_from) {
+      memcpy(scratch_from, scratch.data() + (scratch_from - scratch_dest), received - scratch_from);
+      client.progress(Chunk{file_offset(scratch_from), static_cast<size_t>(received - scratch_from)});
+      scratch_from = received;
+    }
+    client.release(range, Chunk{file_offset(scratch_from), static_cast<size_t>(dest_end - scratch_from)});
+  } else if(begin != nullptr) {
+    client.release(range, Chunk{file_offset(begin), claim_end() - file_offset(begin)});
+  } else {
+    client.in_flight.erase(range);
+  }
+  range = Chunk{0, 0};
+  begin = end = nullptr;
+  scratch_dest = scratch_from = nullptr;
+  std::vector<uint8_t>().swap(scratch);
+  client.unmap_window(*this);
+
+  // Last, since it may finish the download, which closes every connection
+  // still open; this one must already be closing with its range released
+  if(--mirror->connections == 0) {
+    if(idle_closed) {
+      client.mirror_dormant(*mirror);
+    } else {
+      client.mirror_lost(*mirror);
+    }
   }
-  client.balance_chunks();
 }
 
 void Connection::get(Chunk chunk) {
   assert(state == Connection::State::IDLE);
-  state = Connection::State::GET_HEADERS;
+  set_state(Connection::State::GET_HEADERS);
 
-  begin = client.file_data + chunk.off;
+  range = chunk;
+  if(!client.map_window(*this, chunk)) {
+    return;
+  }
+  begin = mapped(chunk.off);
   end = begin + chunk.len;
+  request(chunk.off, chunk.len);
+}
 
-  std::ostringstream builder;
-  builder << "GET " << path << " HTTP/1.1\r\n"
-          << "Host: " << host << "\r\n"
-          << "Range: bytes=" << begin - client.file_data
-          << "-" << end - client.file_data - 1 << "\r\n"
-          << "User-Agent: " << client.user_agent << "\r\n"
-          << "Connection: keep-alive\r\n"
-          << "\r\n";
-  get_req = builder.str();
+void Connection::stream() {
+  assert(state == Connection::State::IDLE);
+  set_state(Connection::State::GET_STREAM);
+  stream_offset = 0;
+  request(0, 0);
+}
 
-  uv_buf_t buf;
-  buf.base = const_cast<char *>(get_req.data());
-  buf.len = get_req.size();
+void Connection::accept_whole_body() {
+  whole_body = true;
+  skip = range.off;
+  if(client.ranges_elsewhere(*this)) {
+    // Stop at the end of our claim and leave the rest to them
+    return;
+  }
+
+  // Nobody else can fetch ranges, so keep everything from here on
+  Chunk rest{range.off + range.len, static_cast<size_t>(client.file_size - (range.off + range.len))};
+  if(rest.len != 0) {
+    client.pending.erase(rest);
+    client.in_flight.insert(rest);
+    range.len += rest.len;
+  }
+  client.unmap_window(*this);
+  // Windows keep their size however much was claimed; on_body slides along
+  Chunk window{range.off, client.window_size != 0 ? std::min<size_t>(range.len, client.window_size) : range.len};
+  if(!client.map_window(*this, window)) {
+    return;
+  }
+  begin = mapped(window.off);
+  end = begin + window.len;
+}
+
+// Maps the next window of a whole body once the last one has filled
+bool Connection::slide_window() {
+  Chunk window{file_offset(end), 0};
+  window.len = std::min<size_t>(claim_end() - window.off, client.window_size);
+  client.unmap_window(*this);
+  if(!client.map_window(*this, window)) {
+    return false;
+  }
+  begin = mapped(window.off);
+  end = begin + window.len;
+  return true;
+}
+
+void Connection::duplicate(Connection &target) {
+  assert(state == Connection::State::IDLE);
+  assert(target.rival == nullptr && target.scratch_dest == nullptr);
+  set_state(Connection::State::GET_HEADERS);
 
-  uv_write(&write_req, reinterpret_cast<uv_stream_t *>(&handle), &buf, 1, write_cb);
+  rival = &target;
+  target.rival = this;
+  const Chunk tail{target.file_offset(target.begin), static_cast<size_t>(target.end - target.begin)};
+  if(!client.map_window(*this, tail)) {
+    return;
+  }
+  scratch_dest = scratch_from = mapped(tail.off);
+  scratch.resize(tail.len);
+
+  begin = scratch.data();
+  end = begin + scratch.size();
+  request(tail.off, tail.len);
 }
 
-void Connection::process_header(const std::string &name, const std::string &value) {
-  switch(parser.status_code) {
-  case 301:
-  case 302:
-  case 303:
-  case 307:
-  case 308:
-    if(name != "Location") {
+Chunk Connection::shorten() {
+  assert(session == nullptr && !splicing && rival == nullptr && scratch_dest == nullptr);
+  uint8_t *cut = begin + (end - begin) / 2;
+  const Chunk back{file_offset(cut), static_cast<size_t>(end - cut)};
+  end = cut;
+  range.len = back.off - range.off;
+  shortened = true;
+  return back;
+}
+
+void Connection::commit() {
+  // Only the bytes the rival hasn't already written need to land
+  if(rival != nullptr) {
+    scratch_from = mapped(rival->file_offset(rival->begin));
+  }
+  uint8_t *dest_end = scratch_dest + scratch.size();
+  if(dest_end > scratch_from) {
+    memcpy(scratch_from, scratch.data() + (scratch_from - scratch_dest), dest_end - scratch_from);
+    client.progress(Chunk{file_offset(scratch_from), static_cast<size_t>(dest_end - scratch_from)});
+  }
+  if(rival != nullptr) {
+    Connection *loser = rival;
+    rival = nullptr;
+    loser->cancel();
+  }
+  scratch_dest = scratch_from = nullptr;
+  std::vector<uint8_t>().swap(scratch);
+}
+
+void Connection::cancel() {
+  // HTTP/1.1 can't abort a single response, so the connection goes with it;
+  // an HTTP/2 stream is reset on its own, and its session opens another
+  rival = nullptr;
+  scratch_dest = scratch_from = nullptr;
+  begin = end = nullptr;
+  set_state(Connection::State::CANCELLED);
+  close();
+}
+
+void Connection::request(size_t off, size_t len) {
+  set_timeout(client.header_timeout);
+  request_off = off;
+  header_tail = 0;
+  if(session != nullptr) {
+    session->submit(*this, false, off, len);
+    return;
+  }
+
+  static const char range_prefix[] = "Range: bytes=";
+  char *cursor = range_line;
+  if(len != 0) {
+    memcpy(cursor, range_prefix, sizeof(range_prefix) - 1);
+    cursor += sizeof(range_prefix) - 1;
+    cursor = format_decimal(cursor, off);
+    *cursor++ = '-';
+    cursor = format_decimal(cursor, off + len - 1);
+    memcpy(cursor, "\r\n", 2);
+    cursor += 2;
+  }
+  memcpy(cursor, "\r\n", 2);
+  cursor += 2;
+
+  // libuv copies up to four buffers into the request without allocating
+  uv_buf_t bufs[3];
+  bufs[0].base = const_cast<char *>("GET");
+  bufs[0].len = strlen(bufs[0].base);
+  bufs[1].base = const_cast<char *>(request_template.data());
+  bufs[1].len = request_template.size();
+  bufs[2].base = range_line;
+  bufs[2].len = cursor - range_line;
+
+  send(bufs, elementsof(bufs));
+}
+
+void Connection::send_head() {
+  head_sent = uv_now(client.loop);
+  if(session != nullptr) {
+    session->submit(*this, true, 0, 0);
+    return;
+  }
+
+  uv_buf_t bufs[3];
+  bufs[0].base = const_cast<char *>("HEAD");
+  bufs[0].len = strlen(bufs[0].base);
+  bufs[1].base = const_cast<char *>(request_template.data());
+  bufs[1].len = request_template.size();
+  bufs[2].base = const_cast<char *>("\r\n");
+  bufs[2].len = strlen(bufs[2].base);
+
+  send(bufs, elementsof(bufs));
+}
+
+void Connection::start_tls() {
+  ssl = client.tls.create(*this);
+  tls_in = BIO_new(BIO_s_mem());
+  tls_out = BIO_new(BIO_s_mem());
+  SSL_set_bio(ssl, tls_in, tls_out);
+  tls_buffer.resize(64 * 1024);
+
+  receiving = true;
+  watch();
+  send_head();
+}
+
+void Connection::send(uv_buf_t *bufs, unsigned nbufs) {
+  if(ssl == nullptr) {
+    uv_write(&write_req, reinterpret_cast<uv_stream_t *>(&handle), bufs, nbufs, write_cb);
+    return;
+  }
+
+  for(unsigned i = 0; i < nbufs; ++i) {
+    tls_pending.append(bufs[i].base, bufs[i].len);
+  }
+  tls_pump();
+}
+
+bool Connection::tls_pump() {
+  if(!SSL_is_init_finished(ssl)) {
+    int result = SSL_do_handshake(ssl);
+    if(result <= 0) {
+      int error = SSL_get_error(ssl, result);
+      if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        fail_tls(*this, "handshake", result);
+        return false;
+      }
+    }
+  }
+
+  if(SSL_is_init_finished(ssl) && !tls_pending.empty()) {
+    int result = SSL_write(ssl, tls_pending.data(), tls_pending.size());
+    if(result <= 0) {
+      fail_tls(*this, "write", result);
+      return false;
+    }
+    tls_pending.clear();
+  }
+
+  // One write at a time, so its request and buffer can be reused; anything
+  // newer waits in tls_out until it completes
+  size_t ciphertext = BIO_ctrl_pending(tls_out);
+  if(ciphertext != 0 && !tls_writing) {
+    tls_write_buffer.resize(ciphertext);
+    BIO_read(tls_out, tls_write_buffer.data(), ciphertext);
+    uv_buf_t buf = uv_buf_init(tls_write_buffer.data(), ciphertext);
+    if(uv_write(&write_req, reinterpret_cast<uv_stream_t *>(&handle), &buf, 1, tls_write_cb) == 0) {
+      tls_writing = true;
+    }
+  }
+  return true;
+}
+
+void Connection::start_splice() {
+  // Only a plain, exact-length body headed straight for the file qualifies
+  if(client.fd == -1 || ssl != nullptr || session != nullptr || scratch_dest != nullptr || begin == end ||
+     parser.status_code != 206 || (parser.flags & F_CHUNKED) ||
+     parser.content_length != static_cast<uint64_t>(end - begin) ||
+     uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+
+  if(splice_fd == -1) {
+    if(pipe2(splice_pipe, O_CLOEXEC) != 0) {
+      fprintf(stderr, "WARN: Couldn't create pipe for splicing: %s\n", strerror(errno));
       return;
     }
+    fcntl(splice_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+    // A separate descriptor keeps the poll watcher from colliding with the stream's
+    splice_fd = dup(handle.io_watcher.fd);
+    uv_poll_init(client.loop, &splice_poll, splice_fd);
+  }
 
-    redirect = value;
-    break;
+  splicing = true;
+  watch();
+}
 
-  default:
-    break;
+void Connection::watch() {
+  if(!receiving || uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+  auto stream = reinterpret_cast<uv_stream_t *>(&handle);
+  if(splicing) {
+    uv_read_stop(stream);
+    if(client.reading) {
+      uv_poll_start(&splice_poll, UV_READABLE, splice_cb);
+    } else {
+      uv_poll_stop(&splice_poll);
+    }
+  } else if(client.reading) {
+    uv_read_start(stream, alloc_cb, read_cb);
+  } else {
+    uv_read_stop(stream);
   }
 }
+
+void Connection::autotune(uint64_t interval) {
+  int fd = handle.io_watcher.fd;
+  socklen_t len = sizeof(tcp_stats);
+  if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tcp_stats, &len) != 0) {
+    return;
+  }
+
+  uint64_t rate = (stats.received - tuned_bytes) * 1000 / interval;
+  tuned_bytes = stats.received;
+  uint64_t rtt_us = tcp_stats.tcpi_rtt != 0 ? tcp_stats.tcpi_rtt : connect_rtt * 1000;
+  // Twice the BDP leaves room for the window to keep growing
+  uint64_t target = std::min(2 * rate * rtt_us / 1000000, MAX_RCVBUF);
+  read_size = std::max<size_t>(target, MIN_READ_SIZE);
+
+  // An explicit SO_RCVBUF disables the kernel's own tuning, so only step in
+  // once that has fallen behind. The kernel doubles what it's given, and
+  // reports the doubled size.
+  int current;
+  len = sizeof(current);
+  if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &current, &len) != 0) {
+    return;
+  }
+  rcvbuf = current;
+  if(target <= static_cast<uint64_t>(current)) {
+    return;
+  }
+  int value = target;
+  if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &value, sizeof(value)) != 0) {
+    // Unprivileged requests are clamped to rmem_max, which can be well
+    // below what the kernel's tuning has already reached
+    uint64_t limit = rmem_max();
+    if(limit != 0 && 2 * std::min(target, limit) <= static_cast<uint64_t>(current)) {
+      return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+  }
+  int granted;
+  len = sizeof(granted);
+  if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &granted, &len) != 0) {
+    return;
+  }
+  if(granted < current) {
+    // The clamp was unknown; at least don't leave the buffer smaller
+    value = current / 2;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &granted, &len);
+  }
+  rcvbuf = granted;
+}
+
+void Connection::set_state(State next) {
+  if(next == state) {
+    return;
+  }
+  client.transition(*this, state, next);
+  state = next;
+}
+
+void Connection::set_timeout(uint64_t timeout) {
+  if(timeout == 0) {
+    uv_timer_stop(&timer);
+    return;
+  }
+  deadline = uv_now(client.loop) + timeout;
+  uv_timer_start(&timer, timeout_cb, timeout, 0);
+}
+
+void Connection::extend_timeout(uint64_t timeout) {
+  // Cheap enough to call on every read; timeout_cb re-arms lazily
+  if(timeout != 0) {
+    deadline = uv_now(client.loop) + timeout;
+  }
+}
+
+void Connection::process_header(unsigned status_code) {
+  if(header_truncated) {
+    fprintf(stderr, "WARN: Ignoring oversized %s header from %s\n", header_name, host.c_str());
+  } else if(0 == strcasecmp(header_name, "Accept-Ranges")) {
+    ranges_advertised = strcasestr(header_value, "bytes") != nullptr;
+    ranges_refused = !ranges_advertised;
+  } else if(state == Connection::State::HEAD && 0 == strcasecmp(header_name, "ETag")) {
+    validator.assign(header_value, header_value_len);
+  } else if(state == Connection::State::HEAD && 0 == strcasecmp(header_name, "Last-Modified") && validator.empty()) {
+    validator.assign(header_value, header_value_len);
+  } else if(0 == strcasecmp(header_name, "Content-Range")) {
+    // bytes first-last/total
+    content_range_off = 0 == strncasecmp(header_value, "bytes ", 6) ? strtoull(header_value + 6, nullptr, 10) : ~0ULL;
+  } else {
+    switch(status_code) {
+    case 301:
+    case 302:
+    case 303:
+    case 307:
+    case 308:
+      if(0 == strcasecmp(header_name, "Location")) {
+        redirect.assign(header_value, header_value_len);
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  header_name_len = header_value_len = 0;
+  header_in_value = header_truncated = false;
+}
+
+int Connection::on_message_complete(unsigned status_code) {
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return 1;
+  }
+
+  if(state == Connection::State::GET_STREAM) {
+    // Only a 200 gets this far, and its end is the end of the file
+    set_state(Connection::State::IDLE);
+    uv_timer_stop(&timer);
+    client.end_stream(stream_offset);
+    return 1;
+  }
+
+  unsigned expected = state == Connection::State::HEAD || whole_body ? 200 : 206;
+  if((state == Connection::State::HEAD ||
+      state == Connection::State::GET_HEADERS ||
+      state == Connection::State::GET_COPY ||
+      state == Connection::State::GET_DIRECT)
+     && status_code != expected) {
+    fprintf(stderr, "WARN: Abandoning connection to %s due to HTTP %u %s\n", host.c_str(), status_code, status);
+    set_state(Connection::State::FAILED);
+    close();
+    return 0;
+  }
+
+  if(state != Connection::State::HEAD) {
+    client.metrics.copied_bytes.record(copied);
+  }
+  copied = 0;
+  if(scratch_dest != nullptr) {
+    commit();
+  }
+  client.in_flight.erase(range);
+  range = Chunk{0, 0};
+  if(rival != nullptr) {
+    Connection *loser = rival;
+    rival = nullptr;
+    loser->cancel();
+  }
+  begin = end = nullptr;
+  whole_body = false;
+  shortened = false;
+  skip = 0;
+  client.unmap_window(*this);
+
+  set_state(Connection::State::IDLE);
+  uv_timer_stop(&timer);
+
+  return 1;
+}
+
+int Connection::on_headers_complete(unsigned status_code, uint64_t content_length) {
+  if(header_name_len != 0) {
+    process_header(status_code);
+  }
+  const bool advertised = ranges_advertised;
+  const bool refused = ranges_refused;
+  const uint64_t range_off = content_range_off;
+  ranges_advertised = ranges_refused = false;
+  content_range_off = ~0ULL;
+
+  if(!redirect.empty()) {
+    // Add the target before closing, so losing this mirror isn't mistaken for running out
+    client.add_url(redirect.c_str());
+    close();
+    return 0;
+  }
+
+  if(ssl != nullptr && !tls_released) {
+    // Any session ticket arrives before the first response
+    tls_released = true;
+    client.tls.release(*this);
+  }
+
+  stats.start_time = uv_now(client.loop);
+  stats.bytes = 0;
+
+  if(state == Connection::State::HEAD) {
+    if(refused) {
+      mirror->ranges = false;
+    }
+    if(content_length == 0 || content_length == ~0ULL) {
+      // Chunked or undeclared; stream it unless some other mirror says how big it is
+      if(client.file_size == ~0ULL) {
+        client.streaming = true;
+      }
+    } else if(head(content_length)) {
+      fprintf(stderr, "WARN: %s served file of %lu bytes, expected %lu bytes\n", host.c_str(), content_length,
+              client.file_size);
+      set_state(Connection::State::FAILED);
+      close();
+    } else if(client.cache_key.empty() && !validator.empty()) {
+      // The first mirror to vouch for this size names the cache entry
+      client.cache_key = (mirror->tls ? "https://" : "http://") + mirror->req_host + mirror->path + "\n" + validator;
+    }
+    validator.clear();
+
+    if(!mirror->probed && state == Connection::State::HEAD) {
+      mirror->probed = true;
+      mirror->connect_rtt = connect_rtt;
+      mirror->ttfb = uv_now(client.loop) - head_sent;
+    }
+    return 1;
+  }
+
+  if(state == Connection::State::GET_STREAM) {
+    if(status_code != 200) {
+      // Keep error pages out of the output
+      fprintf(stderr, "WARN: Abandoning connection to %s due to HTTP %u %s\n", host.c_str(), status_code, status);
+      set_state(Connection::State::FAILED);
+      close();
+      return 0;
+    }
+    if(content_length != 0 && content_length != ~0ULL && advertised) {
+      // Now that the size is known, the stream becomes the first of many ranges
+      if(!client.go_parallel(content_length)) {
+        return 0;
+      }
+      range = client.take_chunk();
+      if(!client.map_window(*this, range)) {
+        return 0;
+      }
+      begin = mapped(range.off);
+      end = begin + range.len;
+      accept_whole_body();
+      if(client.finished) {
+        return 0;
+      }
+      set_state(Connection::State::GET_COPY);
+      client.defer_schedule();
+    }
+  } else if(state == Connection::State::GET_HEADERS) {
+    if(status_code == 200 && scratch_dest == nullptr) {
+      fprintf(stderr, "WARN: %s ignored the requested range and is sending the whole file\n", host.c_str());
+      mirror->ranges = false;
+      accept_whole_body();
+    } else if(status_code == 206 && range_off != ~0ULL && range_off != request_off) {
+      fprintf(stderr, "WARN: %s sent bytes from %" PRIu64 ", expected %zu\n", host.c_str(), range_off, request_off);
+      set_state(Connection::State::FAILED);
+      close();
+      return 0;
+    }
+    if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle)) || client.finished) {
+      return 0;
+    }
+    set_state(Connection::State::GET_COPY);
+  }
+  set_timeout(client.idle_timeout);
+  return 0;
+}
+
+int Connection::on_body(const char *at, size_t length) {
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return 1;
+  }
+
+  if(state == Connection::State::GET_STREAM) {
+    if(!client.write_stream(stream_offset, at, length)) {
+      return 1;
+    }
+    stream_offset += length;
+    stats.bytes += length;
+    stats.received += length;
+    client.progress(Chunk{stream_offset - length, length});
+    return 0;
+  }
+
+  if(skip != 0) {
+    size_t skipped = std::min<uint64_t>(skip, length);
+    skip -= skipped;
+    at += skipped;
+    length -= skipped;
+    stats.received += skipped;
+  }
+
+  if(whole_body && begin + length > end && file_offset(end) < claim_end()) {
+    // Fill this window, which slides on to the next, then carry on there
+    size_t part = end - begin;
+    return on_body(at, part) != 0 ? 1 : on_body(at + part, length - part);
+  }
+
+  bool truncated = false;
+  if(begin + length > end || (shortened && begin + length == end)) {
+    if(!whole_body && !shortened) {
+      fprintf(stderr, "WARN: Server tried to overflow output\n");
+      return 1;
+    }
+    // The rest of the file is someone else's; HTTP/1.1 can only stop it by closing
+    length = end - begin;
+    truncated = true;
+  }
+
+  if(state == Connection::State::GET_COPY) {
+    memcpy(begin, at, length);
+    copied += length;
+  }
+  begin += length;
+  stats.bytes += length;
+  stats.received += length;
+  if(scratch_dest == nullptr && length != 0) {
+    // Duplicates report progress when their scratch is committed
+    client.progress(Chunk{file_offset(begin) - length, length});
+  }
+  if(whole_body && begin == end && file_offset(end) < claim_end() && !slide_window()) {
+    return 1;
+  }
+
+  if(truncated) {
+    if(scratch_dest != nullptr) {
+      commit();
+    }
+    client.in_flight.erase(range);
+    range = Chunk{0, 0};
+    if(rival != nullptr) {
+      Connection *loser = rival;
+      rival = nullptr;
+      loser->cancel();
+    }
+    begin = end = nullptr;
+    if(shortened && !client.finished && !mirror->failed) {
+      // Only the response was unwanted, not the connection
+      client.add_connection(*mirror);
+    }
+    set_state(Connection::State::COMPLETE);
+    close();
+    return 1;
+  }
+  return 0;
+}
@@ -2,32 +2,46 @@
 #define ANCHOR_CONNECTION_H_
 
 #include <string>
+#include <vector>
 #include <cinttypes>
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 #include <uv.h>
 
+#include <openssl/ssl.h>
+
 #include "http-parser/http_parser.h"
 
-struct Client;
+#include "IntervalSet.h"
+#include "Mirror.h"
 
-struct Chunk {
-  size_t off, len;
-};
+struct Client;
+struct Http2Session;
 
 struct Stats {
   uint64_t start_time = 0;
   uint64_t bytes = 0;
+  // Body bytes over the connection's lifetime, unlike bytes which is per response
+  uint64_t received = 0;
 };
 
 struct Connection {
   // Short-term operations <= IDLE for scheduling convenience
-  enum class State { CONNECT, HEAD, IDLE, GET_HEADERS, GET_COPY, GET_DIRECT, FAILED, COMPLETE };
-
-  Connection(Client &s, std::string h, std::string p) : client(s), host(std::move(h)), path(std::move(p)) {
+  // GET_STREAM fetches a file of unknown size front to back
+  enum class State { CONNECT, HEAD, IDLE, STANDBY, GET_HEADERS, GET_COPY, GET_DIRECT, GET_STREAM, FAILED, CANCELLED,
+                     COMPLETE };
+  static const size_t STATE_COUNT = static_cast<size_t>(State::COMPLETE) + 1;
+
+  // A non-empty server name selects TLS
+  Connection(Client &s, std::string h, std::string p, std::string sn)
+      : client(s), host(std::move(h)), path(std::move(p)), server_name(std::move(sn)) {
+    handle.data = this;
     connect_req.data = this;
     write_req.data = this;
+    timer.data = this;
+    splice_poll.data = this;
     http_parser_init(&parser, HTTP_RESPONSE);
     parser.data = this;
   }
@@ -37,29 +51,179 @@ struct Connection {
   void connect(in6_addr ip, in_port_t port);
   void close();
   void get(Chunk chunk);
+  // Requests the whole file without a range
+  void stream();
+  void duplicate(Connection &target);
+  // Gives up the back half of what's left of the claim and returns it; the
+  // response is cut off once the front half arrives
+  Chunk shorten();
+  void commit();
+  void cancel();
+  void send_head();
+  void start_tls();
+  // Writes a request, through TLS if it's in use
+  void send(uv_buf_t *bufs, unsigned nbufs);
+  // Advances the handshake and flushes ciphertext; false if the connection failed
+  bool tls_pump();
+  // Switches the rest of a response body to splice(2) when it's eligible
+  void start_splice();
+  // Starts or stops reading the socket, by stream or splice, to match
+  // Client::reading; only once the connection has begun reading
+  void watch();
+  // Sizes the receive buffer and read size to the bandwidth-delay product
+  // measured over the last interval milliseconds
+  void autotune(uint64_t interval);
+
+  // Keeps Client's per-state index current; never assign state directly
+  void set_state(State next);
+
+  // Deadlines are in loop time; a timeout of 0 disables the timer
+  void set_timeout(uint64_t timeout);
+  void extend_timeout(uint64_t timeout);
 
   uv_tcp_t handle;
+  uv_timer_t timer;
+  uint64_t deadline = 0;
+  uint64_t connect_start = 0;
+  uint64_t head_sent = 0;
+  // Milliseconds from connect to established, the RTT until TCP_INFO has one
+  uint64_t connect_rtt = 0;
+  // Kernel's view of the socket as of the last autotune
+  struct tcp_info tcp_stats = {};
+  // SO_RCVBUF as the kernel reports it, doubled, as of the last autotune
+  int rcvbuf = 0;
+  uint64_t tuned_bytes = 0;
+  // Cap on a single read; 0 leaves it to the destination
+  size_t read_size = 0;
+  // Minor fault count before a sampled direct read, or -1
+  unsigned fault_sample = 0;
+  long fault_mark = -1;
   uv_connect_t connect_req;
   uv_write_t write_req;
-  std::string get_req;
+  // Everything after the method and before the per-request headers, built
+  // once per connection; requests are written as scatter-gather buffers.
+  std::string request_template;
+  char range_line[64];
 
   State state = State::CONNECT;
+  size_t state_index = 0;
+  unsigned pending_closes = 0;
   http_parser parser;
-  std::string status;
+  // Fixed arena for the status text and the header being parsed;
+  // oversized values are truncated and never acted upon
+  static const size_t STATUS_MAX = 64;
+  static const size_t HEADER_NAME_MAX = 64;
+  static const size_t HEADER_VALUE_MAX = 4096;
+  char status[STATUS_MAX] = {};
+  size_t status_len = 0;
+  char header_name[HEADER_NAME_MAX] = {};
+  size_t header_name_len = 0;
+  char header_value[HEADER_VALUE_MAX];
+  size_t header_value_len = 0;
+  bool header_in_value = false;
+  bool header_truncated = false;
   uint8_t *begin = nullptr;
   uint8_t *end = nullptr;
+  // Reads that can't go straight to the output land here: headers, sized
+  // from the last response's, and bodies that need the parser's help
+  std::vector<char> buffer;
+  size_t header_len = 0;
+  // How much of the blank line ending the headers the last read ended with
+  uint8_t header_tail = 0;
+  // Body bytes of the current response copied out of buffer
+  uint64_t copied = 0;
+  // Where the file is visible to this connection: either the whole-file
+  // mapping or a window mapped around the range being received
+  uint8_t *mapping = nullptr;
+  size_t mapping_off = 0;
+  size_t mapping_len = 0;
+  size_t file_offset(const uint8_t *p) const { return mapping_off + (p - mapping); }
+  uint8_t *mapped(size_t off) const { return mapping + (off - mapping_off); }
+  // Our claim in Client::in_flight; a duplicate inherits it if its rival dies
+  Chunk range{0, 0};
+  size_t claim_end() const { return range.off + range.len; }
   Stats stats;
 
+  // Degraded responses: a stream writes wherever stream_offset has reached,
+  // and a whole file sent in reply to a ranged request has its first skip
+  // bytes discarded and is cut off once the claim is filled. When the output
+  // is mapped in windows, [begin, end) covers one window of the claim at a
+  // time.
+  uint64_t stream_offset = 0;
+  bool whole_body = false;
+  uint64_t skip = 0;
+  // The claim was shortened after the request went out, so the response
+  // runs past end
+  bool shortened = false;
+  // From the headers of the response being parsed
+  size_t request_off = 0;
+  bool ranges_advertised = false;
+  bool ranges_refused = false;
+  uint64_t content_range_off = ~0ULL;
+
+  // End-game: a duplicate fetches its rival's unfinished tail into scratch,
+  // and whichever of the two finishes first cancels the other.
+  Connection *rival = nullptr;
+  std::vector<uint8_t> scratch;
+  uint8_t *scratch_dest = nullptr;
+  uint8_t *scratch_from = nullptr;
+
+  // TLS runs over memory BIOs between the stream and the parser. Plaintext
+  // written before the handshake completes waits in tls_pending.
+  SSL *ssl = nullptr;
+  BIO *tls_in = nullptr;
+  BIO *tls_out = nullptr;
+  std::string tls_pending;
+  std::vector<char> tls_buffer;
+  // Ciphertext being written, through write_req, which plaintext never uses
+  std::vector<char> tls_write_buffer;
+  bool tls_writing = false;
+  bool tls_parked = false;
+  bool tls_released = false;
+
+  // HTTP/2 streams share their session's socket; handle is left unconnected
+  Http2Session *session = nullptr;
+  int32_t stream_id = 0;
+  unsigned stream_status = 0;
+  uint64_t stream_length = ~0ULL;
+  uint32_t stream_window = 0;
+
+  // Splice receive: body bytes move socket -> pipe -> file without being
+  // copied to user space. The poll handle watches a dup of the socket.
+  uv_poll_t splice_poll;
+  int splice_fd = -1;
+  int splice_pipe[2] = {-1, -1};
+  // Reads have begun, and whether splice_poll rather than the stream takes them
+  bool receiving = false;
+  bool splicing = false;
+
+  Mirror *mirror = nullptr;
+  // The server closed it while it had nothing to do, as keep-alive
+  // timeouts do; that leaves the mirror dormant rather than lost
+  bool idle_closed = false;
+  bool idle() const { return state == State::IDLE || state == State::STANDBY; }
   Client &client;
   const std::string host;
   const std::string path;
-
-  std::string header_name;
-  std::string header_value;
+  const std::string server_name;
 
   std::string redirect;
-
-  void process_header(const std::string &name, const std::string &value);
+  // ETag, or Last-Modified without one, from a HEAD response
+  std::string validator;
+
+  void process_header(unsigned status_code);
+
+  // Response events, shared by every transport. Return values follow
+  // http_parser callback conventions.
+  int on_headers_complete(unsigned status_code, uint64_t content_length);
+  int on_body(const char *at, size_t length);
+  int on_message_complete(unsigned status_code);
+
+private:
+  // A zero length requests the whole file
+  void request(size_t off, size_t len);
+  void accept_whole_body();
+  bool slide_window();
 };
 
 #endif
@@ -0,0 +1,336 @@
+#include "Control.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "Client.h"
+
+namespace {
+// Commands are short; anything longer is a confused peer
+const size_t MAX_LINE = 4096;
+// Per mirror; more is a typo rather than a plan
+const uint64_t MAX_CONNECTIONS = 256;
+
+const char *const HELP[] = {
+  "stats", "mirrors", "sockets", "add <url>", "remove <index>", "rate <bytes/s>", "connections <n>", "user-agent <text>",
+  "pause", "resume",
+};
+
+struct Reply {
+  uv_write_t req;
+  std::string text;
+};
+
+void write_cb(uv_write_t *req, int status) {
+  (void)status;
+  delete reinterpret_cast<Reply *>(req);
+}
+
+void listener_close_cb(uv_handle_t *handle) {
+  static_cast<Control *>(handle->data)->client.handle_closed();
+}
+
+void session_close_cb(uv_handle_t *handle) {
+  auto session = static_cast<Control::Session *>(handle->data);
+  session->control.closed(*session);
+}
+
+void connection_cb(uv_stream_t *server, int status) {
+  auto &control = *static_cast<Control *>(server->data);
+  if(status < 0) {
+    fprintf(stderr, "WARN: Control socket: %s\n", uv_strerror(status));
+    return;
+  }
+  control.accept();
+}
+
+void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  (void)suggested_size;
+  auto &session = *static_cast<Control::Session *>(handle->data);
+  buf->base = session.buffer;
+  buf->len = sizeof(session.buffer);
+}
+
+void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  auto &session = *static_cast<Control::Session *>(stream->data);
+  if(nread < 0) {
+    // Hung up, or a read error; either way there's no one left to answer
+    session.control.drop(session);
+    return;
+  }
+  session.input.append(buf->base, nread);
+  session.control.receive(session);
+}
+
+bool parse_unsigned(const std::string &text, uint64_t &value) {
+  if(text.empty() || text[0] < '0' || text[0] > '9') {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  value = strtoull(text.c_str(), &end, 10);
+  return errno == 0 && *end == '\0';
+}
+
+const char *const STATE_NAMES[Connection::STATE_COUNT] = {
+  "connect", "head", "idle", "standby", "get-headers", "get-copy", "get-direct", "get-stream", "failed", "cancelled",
+  "complete",
+};
+
+const char *mirror_state(const Mirror &mirror) {
+  if(mirror.failed) {
+    return mirror.connections != 0 ? "closing" : "failed";
+  }
+  if(mirror.family == 0) {
+    return "resolving";
+  }
+  if(mirror.connections == 0) {
+    return "dormant";
+  }
+  return mirror.standby ? "standby" : "active";
+}
+
+// Whether a socket left at path still has a listener behind it
+bool answers(const char *path) {
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    return false;
+  }
+  bool connected = connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0;
+  int error = errno;
+  ::close(fd);
+  // Only a refusal proves nobody is there; anything else, leave it be
+  return connected || error != ECONNREFUSED;
+}
+}
+
+const char *Control::start(const char *path) {
+  struct stat st;
+  if(lstat(path, &st) == 0) {
+    if(!S_ISSOCK(st.st_mode)) {
+      return "control path exists and isn't a socket";
+    }
+    if(answers(path)) {
+      return "control path is in use by another process";
+    }
+    unlink(path);
+  }
+
+  uv_pipe_init(client.loop, &listener_, 0);
+  listener_.data = this;
+  // Set before binding, so a failure still closes the handle
+  listening_ = true;
+  // Commands can redirect the download, so only its owner may send them;
+  // the socket must never exist with looser permissions, even briefly
+  mode_t mask = umask(S_IRWXG | S_IRWXO);
+  int result = uv_pipe_bind(&listener_, path);
+  umask(mask);
+  if(result == 0) {
+    path_ = path;
+    result = uv_listen(reinterpret_cast<uv_stream_t *>(&listener_), 4, connection_cb);
+  }
+  if(result != 0) {
+    return uv_strerror(result);
+  }
+  // The download, not the socket, decides when the loop is done
+  uv_unref(reinterpret_cast<uv_handle_t *>(&listener_));
+  return nullptr;
+}
+
+void Control::close() {
+  if(!listening_) {
+    return;
+  }
+  listening_ = false;
+  ++client.closing_handles;
+  uv_close(reinterpret_cast<uv_handle_t *>(&listener_), listener_close_cb);
+  for(auto session : sessions_) {
+    drop(*session);
+  }
+  if(!path_.empty()) {
+    unlink(path_.c_str());
+    path_.clear();
+  }
+}
+
+void Control::accept() {
+  // Deleted by its close callback
+  auto session = new Session{{}, *this, {}, {}};
+  uv_pipe_init(client.loop, &session->pipe, 0);
+  session->pipe.data = session;
+  sessions_.push_back(session);
+  if(uv_accept(reinterpret_cast<uv_stream_t *>(&listener_), reinterpret_cast<uv_stream_t *>(&session->pipe)) != 0) {
+    drop(*session);
+    return;
+  }
+  uv_read_start(reinterpret_cast<uv_stream_t *>(&session->pipe), alloc_cb, read_cb);
+}
+
+void Control::receive(Session &session) {
+  for(size_t eol; (eol = session.input.find('\n')) != std::string::npos;) {
+    std::string line = session.input.substr(0, eol);
+    session.input.erase(0, eol + 1);
+    if(!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    execute(session, line);
+    if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&session.pipe))) {
+      return;
+    }
+  }
+  if(session.input.size() > MAX_LINE) {
+    reply(session, "error: line too long");
+    drop(session);
+  }
+}
+
+void Control::drop(Session &session) {
+  auto handle = reinterpret_cast<uv_handle_t *>(&session.pipe);
+  if(uv_is_closing(handle)) {
+    return;
+  }
+  ++client.closing_handles;
+  uv_close(handle, session_close_cb);
+}
+
+void Control::closed(Session &session) {
+  sessions_.erase(std::find(sessions_.begin(), sessions_.end(), &session));
+  delete &session;
+  client.handle_closed();
+}
+
+void Control::execute(Session &session, const std::string &line) {
+  size_t space = line.find(' ');
+  const std::string command = line.substr(0, space);
+  const std::string arg = space != std::string::npos ? line.substr(space + 1) : "";
+  uint64_t value;
+
+  if(command.empty()) {
+    return;
+  } else if(command == "help") {
+    for(auto text : HELP) {
+      reply(session, text);
+    }
+    reply(session, "ok");
+  } else if(command == "stats") {
+    uint64_t elapsed = client.stats.bytes != 0 ? uv_now(client.loop) - client.stats.start_time : 0;
+    unsigned connections = 0;
+    for(const auto &mirror : client.mirrors) {
+      connections += mirror.connections;
+    }
+    reply(session, "ok bytes=" + std::to_string(client.stats.bytes) +
+          " size=" + (client.file_size != ~0ULL ? std::to_string(client.file_size) : "unknown") +
+          " average=" + std::to_string(elapsed != 0 ? client.stats.bytes * 1000 / elapsed : 0) +
+          " connections=" + std::to_string(connections) +
+          " target=" + std::to_string(client.autoscale_max != 0 ? client.scale_target : 0) +
+          " rate=" + std::to_string(client.rate_limit) +
+          " paused=" + (client.paused ? "1" : "0"));
+  } else if(command == "mirrors") {
+    for(size_t i = 0; i < client.mirrors.size(); ++i) {
+      const auto &mirror = client.mirrors[i];
+      reply(session, std::to_string(i) + " " + mirror_state(mirror) + " " + std::to_string(mirror.connections) +
+            (mirror.tls ? " https://" : " http://") + mirror.req_host + mirror.path);
+    }
+    reply(session, "ok");
+  } else if(command == "sockets") {
+    // The kernel's view as of the last autotune, which samples bodies
+    // arriving over connections of their own
+    for(size_t i = 0; i < client.mirrors.size(); ++i) {
+      for(size_t s = 0; s <= static_cast<size_t>(Connection::State::GET_STREAM); ++s) {
+        for(auto conn : client.in_state(static_cast<Connection::State>(s))) {
+          if(conn->mirror != &client.mirrors[i]) {
+            continue;
+          }
+          const auto &info = conn->tcp_stats;
+          reply(session, std::to_string(i) + " " + STATE_NAMES[s] + (conn->session != nullptr ? " http2" : " http1") +
+                " rtt_us=" + std::to_string(info.tcpi_rtt) +
+                " cwnd=" + std::to_string(info.tcpi_snd_cwnd) +
+                " rcv_space=" + std::to_string(info.tcpi_rcv_space) +
+                " rcvbuf=" + std::to_string(conn->rcvbuf) +
+                " read_size=" + std::to_string(conn->read_size) +
+                " received=" + std::to_string(conn->stats.received));
+        }
+      }
+    }
+    reply(session, "ok");
+  } else if(command == "add") {
+    size_t index = client.mirrors.size();
+    if(arg.empty() || !client.add_url(arg.c_str())) {
+      reply(session, "error: unusable URL");
+    } else {
+      reply(session, "ok " + std::to_string(index));
+    }
+  } else if(command == "remove") {
+    if(!parse_unsigned(arg, value) || value >= client.mirrors.size()) {
+      reply(session, "error: no such mirror");
+      return;
+    }
+    auto &mirror = client.mirrors[value];
+    bool others = false;
+    for(const auto &other : client.mirrors) {
+      if(&other != &mirror && !other.failed) {
+        others = true;
+      }
+    }
+    if(mirror.failed) {
+      reply(session, "error: mirror has already failed");
+    } else if(!others) {
+      reply(session, "error: can't remove the last usable mirror");
+    } else {
+      client.remove_mirror(mirror);
+      reply(session, "ok");
+    }
+  } else if(command == "rate") {
+    if(!parse_unsigned(arg, value)) {
+      reply(session, "error: rate takes bytes per second");
+    } else {
+      client.set_rate_limit(value);
+      reply(session, "ok");
+    }
+  } else if(command == "connections") {
+    if(!parse_unsigned(arg, value) || value == 0 || value > MAX_CONNECTIONS) {
+      reply(session, "error: connections takes a count from 1 to " + std::to_string(MAX_CONNECTIONS));
+    } else {
+      client.set_connection_target(value);
+      reply(session, "ok");
+    }
+  } else if(command == "user-agent") {
+    // It's pasted into request headers
+    if(arg.empty() || std::any_of(arg.begin(), arg.end(), [](char ch) { return ch >= 0 && ch < ' '; })) {
+      reply(session, "error: user-agent takes printable text");
+    } else {
+      user_agent_ = arg;
+      client.user_agent = user_agent_.c_str();
+      reply(session, "ok");
+    }
+  } else if(command == "pause" || command == "resume") {
+    client.set_paused(command == "pause");
+    reply(session, "ok");
+  } else {
+    reply(session, "error: unknown command " + command);
+  }
+}
+
+void Control::reply(Session &session, std::string text) {
+  auto stream = reinterpret_cast<uv_stream_t *>(&session.pipe);
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(stream))) {
+    return;
+  }
+  // Deleted by its write callback, which runs even if the session closes first
+  auto write = new Reply{{}, std::move(text)};
+  write->text += '\n';
+  uv_buf_t buf = uv_buf_init(&write->text[0], write->text.size());
+  if(uv_write(&write->req, stream, &buf, 1, write_cb) != 0) {
+    delete write;
+  }
+}
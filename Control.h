@@ -0,0 +1,66 @@
+#ifndef ANCHOR_CONTROL_H_
+#define ANCHOR_CONTROL_H_
+
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+struct Client;
+
+// Line-based commands over a Unix-domain socket, for adjusting a download
+// while it runs:
+//
+//   stats                  totals, rate, limits and connection counts
+//   mirrors                one line per mirror: index, state, connections, URL
+//   sockets                one line per connection: mirror index, state,
+//                          transport, TCP rtt, cwnd, rcv_space and buffer sizes
+//   add <url>              starts resolving another mirror
+//   remove <index>         closes a mirror's connections and stops using it
+//   rate <bytes/s>         caps the receive rate; 0 removes the cap
+//   connections <n>        fixes connections per mirror, overriding autoscaling
+//   user-agent <text>      sent by connections opened from now on
+//   pause / resume
+//   help                   lists these
+//
+// Every reply ends with a line starting "ok" or "error:".
+class Control {
+public:
+  explicit Control(Client &c) : client(c) {}
+
+  // Returns nullptr on success, or a description of the failure. A stale
+  // socket left at path by an earlier run is replaced.
+  const char *start(const char *path);
+  // Stops listening and drops every session; the closes count in
+  // Client::closing_handles
+  void close();
+
+  // One accepted connection; input holds a partial command
+  struct Session {
+    uv_pipe_t pipe;
+    Control &control;
+    std::string input;
+    char buffer[1024];
+  };
+
+  void accept();
+  // Runs every complete line in the session's input
+  void receive(Session &session);
+  void drop(Session &session);
+  void closed(Session &session);
+
+  Client &client;
+
+private:
+  void execute(Session &session, const std::string &line);
+  void reply(Session &session, std::string text);
+
+  uv_pipe_t listener_;
+  bool listening_ = false;
+  std::string path_;
+  std::vector<Session *> sessions_;
+  // Storage for a user agent set at runtime; Client only points at it
+  std::string user_agent_;
+};
+
+#endif
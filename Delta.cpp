@@ -0,0 +1,298 @@
+#include "Delta.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+namespace {
+// Below this many blocks per slice, another thread costs more than it saves
+const size_t MIN_SLICE_BLOCKS = 256;
+
+uint32_t rotl(uint32_t x, int n) {
+  return x << n | x >> (32 - n);
+}
+
+// RFC 1320. Only used to confirm blocks, so speed matters more than generality.
+class Md4 {
+public:
+  void update(const uint8_t *data, size_t len) {
+    bits_ += static_cast<uint64_t>(len) * 8;
+    if(used_ != 0) {
+      size_t take = std::min(len, sizeof(buffer_) - used_);
+      memcpy(buffer_ + used_, data, take);
+      used_ += take;
+      data += take;
+      len -= take;
+      if(used_ < sizeof(buffer_)) {
+        return;
+      }
+      block(buffer_);
+      used_ = 0;
+    }
+    for(; len >= sizeof(buffer_); data += sizeof(buffer_), len -= sizeof(buffer_)) {
+      block(data);
+    }
+    memcpy(buffer_, data, len);
+    used_ = len;
+  }
+
+  void final(uint8_t digest[16]) {
+    uint64_t bits = bits_;
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = (used_ < 56 ? 56 : 120) - used_;
+    for(int i = 0; i < 8; ++i) {
+      pad[pad_len + i] = bits >> (8 * i);
+    }
+    update(pad, pad_len + 8);
+    for(int i = 0; i < 16; ++i) {
+      digest[i] = state_[i / 4] >> (8 * (i % 4));
+    }
+  }
+
+private:
+  void block(const uint8_t *p) {
+    uint32_t x[16];
+    for(int i = 0; i < 16; ++i) {
+      x[i] = p[4 * i] | p[4 * i + 1] << 8 | p[4 * i + 2] << 16 | static_cast<uint32_t>(p[4 * i + 3]) << 24;
+    }
+
+    static const int order[3][16] = {
+      {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+      {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15},
+      {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15},
+    };
+    static const int shifts[3][4] = {{3, 7, 11, 19}, {3, 5, 9, 13}, {3, 9, 11, 15}};
+    static const uint32_t constants[3] = {0, 0x5a827999, 0x6ed9eba1};
+
+    uint32_t v[4] = {state_[0], state_[1], state_[2], state_[3]};
+    for(int round = 0; round < 3; ++round) {
+      for(int i = 0; i < 16; ++i) {
+        // Steps update a, d, c, b in turn, mixing the other three
+        int t = (4 - i % 4) % 4;
+        uint32_t b = v[(t + 1) % 4], c = v[(t + 2) % 4], d = v[(t + 3) % 4];
+        uint32_t f = round == 0 ? (b & c) | (~b & d) : round == 1 ? (b & c) | (b & d) | (c & d) : b ^ c ^ d;
+        v[t] = rotl(v[t] + f + x[order[round][i]] + constants[round], shifts[round][i % 4]);
+      }
+    }
+    for(int i = 0; i < 4; ++i) {
+      state_[i] += v[i];
+    }
+  }
+
+  uint32_t state_[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint64_t bits_ = 0;
+  uint8_t buffer_[64];
+  size_t used_ = 0;
+};
+
+// zsync's rolling checksum: a sums the bytes, b weights them by distance from the window's end
+void rsum(const uint8_t *data, size_t len, uint16_t &a, uint16_t &b) {
+  // Kept free of loop-carried dependencies beyond the sums, so it vectorises
+  uint32_t sa = 0, sb = 0;
+  for(size_t i = 0; i < len; ++i) {
+    sa += data[i];
+    sb += static_cast<uint32_t>(len - i) * data[i];
+  }
+  a = sa;
+  b = sb;
+}
+}
+
+const char *BlockMap::load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if(file == nullptr) {
+    return strerror(errno);
+  }
+  std::string data;
+  char buffer[64 * 1024];
+  for(size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) != 0;) {
+    data.append(buffer, n);
+  }
+  bool failed = ferror(file) != 0;
+  fclose(file);
+  if(failed) {
+    return "read error";
+  }
+
+  // "Key: value" lines, then a blank line, then the per-block checksums
+  size_t pos = 0;
+  for(;;) {
+    size_t eol = data.find('\n', pos);
+    if(eol == std::string::npos) {
+      return "truncated header";
+    }
+    std::string line = data.substr(pos, eol - pos);
+    pos = eol + 1;
+    if(line.empty()) {
+      break;
+    }
+    size_t colon = line.find(": ");
+    if(colon == std::string::npos) {
+      return "malformed header line";
+    }
+    std::string key = line.substr(0, colon);
+    const char *value = line.c_str() + colon + 2;
+    if(key == "Blocksize") {
+      block_size = strtoull(value, nullptr, 10);
+    } else if(key == "Length") {
+      length = strtoull(value, nullptr, 10);
+    } else if(key == "Hash-Lengths") {
+      if(3 != sscanf(value, "%u,%u,%u", &seq_matches_, &rsum_bytes_, &checksum_bytes_)) {
+        return "malformed Hash-Lengths";
+      }
+    } else if(key == "SHA-1") {
+      sha1 = value;
+    }
+  }
+
+  if(block_size == 0 || length == 0) {
+    return "missing Blocksize or Length";
+  }
+  if(seq_matches_ < 1 || seq_matches_ > 8 || rsum_bytes_ < 1 || rsum_bytes_ > 4 || checksum_bytes_ < 3 ||
+     checksum_bytes_ > 16) {
+    return "unsupported Hash-Lengths";
+  }
+  if(data.size() - pos != blocks() * (rsum_bytes_ + checksum_bytes_)) {
+    return "checksum table doesn't match the file length";
+  }
+
+  // Stored big-endian as the low rsum_bytes of (a << 16 | b)
+  rsum_mask_ = rsum_bytes_ == 4 ? ~0U : (1U << (8 * rsum_bytes_)) - 1;
+  entries_.resize(blocks());
+  rsums_.resize(blocks());
+  checksums_.resize(blocks() * checksum_bytes_);
+  auto p = reinterpret_cast<const uint8_t *>(data.data()) + pos;
+  for(size_t i = 0; i < blocks(); ++i) {
+    uint32_t value = 0;
+    for(unsigned j = 0; j < rsum_bytes_; ++j) {
+      value = value << 8 | *p++;
+    }
+    entries_[i] = Entry{value, static_cast<uint32_t>(i)};
+    rsums_[i] = value;
+    memcpy(&checksums_[i * checksum_bytes_], p, checksum_bytes_);
+    p += checksum_bytes_;
+  }
+  std::sort(entries_.begin(), entries_.end(), [](const Entry &x, const Entry &y) {
+      return x.rsum < y.rsum;
+    });
+  return nullptr;
+}
+
+std::vector<BlockMap::Match> BlockMap::find(const uint8_t *seed, size_t seed_len, unsigned threads) const {
+  size_t max_threads = seed_len / (block_size * MIN_SLICE_BLOCKS) + 1;
+  threads = std::max<size_t>(1, std::min<size_t>(threads, max_threads));
+  size_t slice = (seed_len + threads - 1) / threads;
+
+  std::vector<std::vector<Match>> results(threads);
+  std::vector<std::thread> workers;
+  for(unsigned t = 1; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+        scan(seed, seed_len, t * slice, std::min(seed_len, (t + 1) * slice), results[t]);
+      });
+  }
+  scan(seed, seed_len, 0, std::min(seed_len, slice), results[0]);
+  for(auto &worker : workers) {
+    worker.join();
+  }
+
+  std::vector<Match> matches;
+  std::vector<bool> found(blocks());
+  for(const auto &result : results) {
+    for(const auto &match : result) {
+      if(!found[match.block]) {
+        found[match.block] = true;
+        matches.push_back(match);
+      }
+    }
+  }
+  return matches;
+}
+
+void BlockMap::scan(const uint8_t *seed, size_t seed_len, size_t from, size_t to, std::vector<Match> &out) const {
+  if(seed_len < block_size) {
+    return;
+  }
+  // Windows may extend past the slice, but not past the seed
+  to = std::min(to, seed_len - block_size + 1);
+
+  std::vector<bool> found(blocks());
+  uint16_t a = 0, b = 0;
+  bool fresh = true;
+  for(size_t pos = from; pos < to;) {
+    if(fresh) {
+      rsum(seed + pos, block_size, a, b);
+      fresh = false;
+    }
+
+    uint32_t key = (static_cast<uint32_t>(a) << 16 | b) & rsum_mask_;
+    auto candidates = std::equal_range(entries_.begin(), entries_.end(), Entry{key, 0},
+                                       [](const Entry &x, const Entry &y) { return x.rsum < y.rsum; });
+    bool matched = false;
+    uint8_t digest[16];
+    bool hashed = false;
+    for(auto it = candidates.first; it != candidates.second; ++it) {
+      if(found[it->block]) {
+        continue;
+      }
+      if(!hashed) {
+        Md4 md4;
+        md4.update(seed + pos, block_size);
+        md4.final(digest);
+        hashed = true;
+      }
+      if(0 == memcmp(digest, &checksums_[it->block * checksum_bytes_], checksum_bytes_) &&
+         confirmed(seed, seed_len, it->block, pos)) {
+        found[it->block] = true;
+        out.push_back(Match{it->block, pos});
+        matched = true;
+      }
+    }
+
+    if(matched) {
+      // Unchanged data tends to continue; look for the next block right after
+      pos += block_size;
+      fresh = true;
+      continue;
+    }
+    if(pos + block_size < seed_len) {
+      uint8_t leaving = seed[pos], entering = seed[pos + block_size];
+      a += entering - leaving;
+      b += a - static_cast<uint16_t>(block_size * leaving);
+    }
+    ++pos;
+  }
+}
+
+bool BlockMap::matches(const uint8_t *seed, size_t seed_len, size_t block, size_t pos) const {
+  if(pos + block_size > seed_len) {
+    return false;
+  }
+  uint16_t a, b;
+  rsum(seed + pos, block_size, a, b);
+  if(((static_cast<uint32_t>(a) << 16 | b) & rsum_mask_) != rsums_[block]) {
+    return false;
+  }
+  uint8_t digest[16];
+  Md4 md4;
+  md4.update(seed + pos, block_size);
+  md4.final(digest);
+  return 0 == memcmp(digest, &checksums_[block * checksum_bytes_], checksum_bytes_);
+}
+
+bool BlockMap::confirmed(const uint8_t *seed, size_t seed_len, size_t block, size_t pos) const {
+  // The run may extend either way, so blocks at the end of the file count too
+  size_t want = std::min<size_t>(seq_matches_, blocks());
+  size_t run = 1;
+  for(size_t j = 1; run < want && block + j < blocks() && matches(seed, seed_len, block + j, pos + j * block_size); ++j) {
+    ++run;
+  }
+  for(size_t j = 1; run < want && j <= block && j * block_size <= pos &&
+        matches(seed, seed_len, block - j, pos - j * block_size); ++j) {
+    ++run;
+  }
+  return run >= want;
+}
@@ -0,0 +1,58 @@
+#ifndef ANCHOR_DELTA_H_
+#define ANCHOR_DELTA_H_
+
+#include <string>
+#include <vector>
+#include <cinttypes>
+#include <cstddef>
+
+// Per-block checksums of the file being downloaded, read from a .zsync
+// control file: a truncated rolling checksum finds candidate blocks in a
+// seed cheaply and a truncated MD4 confirms them.
+class BlockMap {
+public:
+  // Returns nullptr on success, or a description of the failure
+  const char *load(const char *path);
+
+  struct Match {
+    size_t block;
+    uint64_t seed_off;
+  };
+  // Blocks found in the seed, at most one match each. The seed is split
+  // into slices scanned on up to threads threads.
+  std::vector<Match> find(const uint8_t *seed, size_t seed_len, unsigned threads) const;
+
+  size_t blocks() const { return (length + block_size - 1) / block_size; }
+
+  uint64_t length = 0;
+  size_t block_size = 0;
+  // Whole-file SHA-1 in hex, if the control file gives one
+  std::string sha1;
+
+private:
+  struct Entry {
+    uint32_t rsum;
+    uint32_t block;
+  };
+
+  // Finds matches for windows starting in [from, to)
+  void scan(const uint8_t *seed, size_t seed_len, size_t from, size_t to, std::vector<Match> &out) const;
+  // Whether the seed window at pos has block's checksums
+  bool matches(const uint8_t *seed, size_t seed_len, size_t block, size_t pos) const;
+  // Whether block at pos sits in a run of seq_matches_ consecutive matching
+  // blocks; with checksums truncated this far, one match alone proves little
+  bool confirmed(const uint8_t *seed, size_t seed_len, size_t block, size_t pos) const;
+
+  unsigned seq_matches_ = 1;
+  unsigned rsum_bytes_ = 0;
+  unsigned checksum_bytes_ = 0;
+  uint32_t rsum_mask_ = 0;
+  // Sorted by rsum for equal_range lookups
+  std::vector<Entry> entries_;
+  // checksum_bytes_ per block, in block order
+  std::vector<uint8_t> checksums_;
+  // Truncated rsums in block order, for checking a match's neighbours
+  std::vector<uint32_t> rsums_;
+};
+
+#endif
@@ -0,0 +1,472 @@
+#include "Http2.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "Client.h"
+#include "Connection.h"
+#include "Util.h"
+
+namespace {
+const uint32_t INITIAL_STREAM_WINDOW = 256 * 1024;
+const uint32_t MIN_STREAM_WINDOW = 64 * 1024;
+const uint32_t MAX_STREAM_WINDOW = 16 * 1024 * 1024;
+// Large enough that per-stream windows are the only limit
+const int32_t SESSION_WINDOW = 1 << 30;
+
+nghttp2_nv make_nv(const char *name, const char *value, size_t value_len) {
+  nghttp2_nv nv;
+  nv.name = reinterpret_cast<uint8_t *>(const_cast<char *>(name));
+  nv.namelen = strlen(name);
+  nv.value = reinterpret_cast<uint8_t *>(const_cast<char *>(value));
+  nv.valuelen = value_len;
+  nv.flags = NGHTTP2_NV_FLAG_NONE;
+  return nv;
+}
+
+Connection *stream_of(nghttp2_session *session, int32_t stream_id) {
+  return static_cast<Connection *>(nghttp2_session_get_stream_user_data(session, stream_id));
+}
+
+// Reads a header value's leading digits in place; false if there are none
+// or they overflow
+bool parse_decimal(const uint8_t *value, size_t len, uint64_t &result) {
+  uint64_t parsed = 0;
+  size_t i = 0;
+  for(; i < len && value[i] >= '0' && value[i] <= '9'; ++i) {
+    unsigned digit = value[i] - '0';
+    if(parsed > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    parsed = parsed * 10 + digit;
+  }
+  if(i == 0) {
+    return false;
+  }
+  result = parsed;
+  return true;
+}
+
+bool matches(const uint8_t *name, size_t len, const char *expected) {
+  return len == strlen(expected) && 0 == memcmp(name, expected, len);
+}
+
+void complete(Http2Session &self, Connection &stream) {
+  nghttp2_session_set_stream_user_data(self.session, stream.stream_id, nullptr);
+  stream.stream_id = 0;
+  stream.on_message_complete(stream.stream_status);
+  stream.stream_status = 0;
+  stream.stream_length = ~0ULL;
+  self.work_ready = true;
+}
+
+int on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                 const uint8_t *name, size_t name_len, const uint8_t *value, size_t value_len,
+                 uint8_t flags, void *user_data) {
+  (void)flags;
+  (void)user_data;
+  if(frame->hd.type != NGHTTP2_HEADERS) {
+    return 0;
+  }
+  auto stream = stream_of(session, frame->hd.stream_id);
+  if(stream == nullptr) {
+    return 0;
+  }
+
+  uint64_t number;
+  if(matches(name, name_len, ":status")) {
+    stream->stream_status = parse_decimal(value, value_len, number) && number <= 999 ? number : 0;
+  } else if(matches(name, name_len, "content-length")) {
+    if(parse_decimal(value, value_len, number)) {
+      stream->stream_length = number;
+    }
+  } else {
+    stream->header_name_len = stream->header_value_len = 0;
+    stream->header_truncated = false;
+    if(name_len >= Connection::HEADER_NAME_MAX) {
+      name_len = Connection::HEADER_NAME_MAX - 1;
+      stream->header_truncated = true;
+    }
+    if(value_len >= Connection::HEADER_VALUE_MAX) {
+      value_len = Connection::HEADER_VALUE_MAX - 1;
+      stream->header_truncated = true;
+    }
+    memcpy(stream->header_name, name, name_len);
+    stream->header_name[name_len] = '\0';
+    memcpy(stream->header_value, value, value_len);
+    stream->header_value[value_len] = '\0';
+    stream->header_name_len = name_len;
+    stream->header_value_len = value_len;
+    stream->process_header(stream->stream_status);
+  }
+  return 0;
+}
+
+int on_frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+  auto &self = *static_cast<Http2Session *>(user_data);
+  if(frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) {
+    return 0;
+  }
+  auto stream = stream_of(session, frame->hd.stream_id);
+  if(stream == nullptr) {
+    return 0;
+  }
+
+  if(frame->hd.type == NGHTTP2_HEADERS && (frame->hd.flags & NGHTTP2_FLAG_END_HEADERS) &&
+     stream->stream_status >= 200) {
+    stream->on_headers_complete(stream->stream_status, stream->stream_length);
+    if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&stream->handle))) {
+      return 0;
+    }
+  }
+
+  if(frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+    complete(self, *stream);
+  }
+  return 0;
+}
+
+int on_data_chunk_recv_cb(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                          const uint8_t *data, size_t len, void *user_data) {
+  (void)flags;
+  auto &self = *static_cast<Http2Session *>(user_data);
+  auto stream = stream_of(session, stream_id);
+  if(stream == nullptr) {
+    return 0;
+  }
+
+  if(stream->on_body(reinterpret_cast<const char *>(data), len) != 0) {
+    if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&stream->handle))) {
+      // Cut off at the end of its claim, or the download is over
+      return 0;
+    }
+    stream->set_state(Connection::State::FAILED);
+    stream->close();
+    return 0;
+  }
+  stream->extend_timeout(self.client.idle_timeout);
+  self.tune_window(*stream);
+  return 0;
+}
+
+int on_stream_close_cb(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data) {
+  (void)user_data;
+  auto stream = stream_of(session, stream_id);
+  if(stream == nullptr) {
+    return 0;
+  }
+
+  // Completed streams were already detached from their Connection
+  fprintf(stderr, "WARN: HTTP/2 stream to %s closed early (error %u)\n", stream->host.c_str(), error_code);
+  nghttp2_session_set_stream_user_data(session, stream_id, nullptr);
+  stream->stream_id = 0;
+  stream->set_state(Connection::State::FAILED);
+  stream->close();
+  return 0;
+}
+
+void session_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  (void)suggested_size;
+  auto &self = *static_cast<Http2Session *>(handle->data);
+  buf->base = self.read_buffer.data();
+  buf->len = self.read_buffer.size();
+}
+
+void session_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  auto &self = *static_cast<Http2Session *>(stream->data);
+  if(nread < 0) {
+    if(!self.closing && std::all_of(self.streams.begin(), self.streams.end(), [](const Connection *s) {
+          return s->idle();
+        })) {
+      // Closed for idleness; the mirror can open another session when needed
+      self.closing = true;
+      auto idle = self.streams;
+      for(auto s : idle) {
+        s->idle_closed = true;
+        s->set_state(Connection::State::COMPLETE);
+        s->close();
+      }
+      self.shutdown();
+      return;
+    }
+    self.fail("read", nread == UV__EOF ? "connection closed" : uv_strerror(nread));
+    return;
+  }
+
+  self.client.account_read(nread);
+  self.receiving = true;
+  auto result = nghttp2_session_mem_recv(self.session, reinterpret_cast<const uint8_t *>(buf->base), nread);
+  self.receiving = false;
+  if(result < 0) {
+    self.fail("protocol", nghttp2_strerror(result));
+  }
+
+  // Requests issued while parsing are only submitted once it's done
+  if(self.work_ready) {
+    self.work_ready = false;
+    self.client.schedule_work();
+  }
+  if(self.closing) {
+    self.shutdown();
+  } else {
+    self.flush();
+  }
+}
+
+void session_write_cb(uv_write_t *req, int status) {
+  auto &self = *static_cast<Http2Session *>(req->data);
+  self.writing = false;
+  if(status < 0 && status != UV_ECANCELED) {
+    self.fail("write", uv_strerror(status));
+  } else if(status == 0) {
+    // Send whatever was queued while this write was out
+    self.flush();
+  }
+}
+
+void session_close_cb(uv_handle_t *handle) {
+  auto session = static_cast<Http2Session *>(handle->data);
+  auto &client = session->client;
+  client.sessions.erase(std::find(client.sessions.begin(), client.sessions.end(), session));
+  delete session;
+  --client.live_sessions;
+  client.maybe_done();
+}
+
+void session_connect_cb(uv_connect_t *req, int status) {
+  auto &self = *static_cast<Http2Session *>(req->data);
+  if(status == UV_ECANCELED) {
+    return;
+  }
+  if(status < 0) {
+    self.fail("connect", uv_strerror(status));
+    return;
+  }
+  self.rtt = uv_now(self.client.loop) - self.connect_start;
+
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_session_callbacks_new(&callbacks);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_cb);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_cb);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_cb);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_cb);
+  nghttp2_session_client_new(&self.session, callbacks, &self);
+  nghttp2_session_callbacks_del(callbacks);
+
+  const nghttp2_settings_entry settings[] = {
+    {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+    {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, INITIAL_STREAM_WINDOW},
+  };
+  nghttp2_submit_settings(self.session, NGHTTP2_FLAG_NONE, settings, elementsof(settings));
+  nghttp2_session_set_local_window_size(self.session, NGHTTP2_FLAG_NONE, 0, SESSION_WINDOW);
+
+  self.read_buffer.resize(64 * 1024);
+  self.watch();
+
+  // Copy, since a failed submission detaches its stream
+  auto streams = self.streams;
+  for(auto stream : streams) {
+    stream->connect_rtt = self.rtt;
+    stream->set_state(Connection::State::HEAD);
+    stream->set_timeout(self.client.header_timeout);
+    stream->send_head();
+  }
+  self.flush();
+}
+}
+
+Http2Session::~Http2Session() {
+  if(session != nullptr) {
+    nghttp2_session_del(session);
+  }
+}
+
+void Http2Session::connect(in_addr ip, in_port_t port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr = ip;
+  start_connect(reinterpret_cast<struct sockaddr *>(&addr));
+}
+
+void Http2Session::connect(in6_addr ip, in_port_t port) {
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = ip;
+  start_connect(reinterpret_cast<struct sockaddr *>(&addr));
+}
+
+void Http2Session::start_connect(const sockaddr *addr) {
+  uv_tcp_init(client.loop, &handle);
+  connect_start = uv_now(client.loop);
+  for(auto stream : streams) {
+    stream->set_timeout(client.connect_timeout);
+  }
+  uv_tcp_connect(&connect_req, &handle, addr, session_connect_cb);
+}
+
+void Http2Session::add_stream(Connection &stream) {
+  stream.session = this;
+  streams.push_back(&stream);
+}
+
+void Http2Session::submit(Connection &stream, bool head, size_t off, size_t len) {
+  char range[64];
+  char *cursor = range;
+  const bool ranged = !head && len != 0;
+  if(ranged) {
+    memcpy(cursor, "bytes=", 6);
+    cursor += 6;
+    cursor = format_decimal(cursor, off);
+    *cursor++ = '-';
+    cursor = format_decimal(cursor, off + len - 1);
+  }
+
+  const char *method = head ? "HEAD" : "GET";
+  const nghttp2_nv headers[] = {
+    make_nv(":method", method, strlen(method)),
+    make_nv(":scheme", "http", 4),
+    make_nv(":authority", host.data(), host.size()),
+    make_nv(":path", path.data(), path.size()),
+    make_nv("user-agent", client.user_agent, strlen(client.user_agent)),
+    make_nv("range", range, cursor - range),
+  };
+  // nghttp2 copies the headers, so the range can live on our stack
+  auto id = nghttp2_submit_request(session, nullptr, headers, elementsof(headers) - (ranged ? 0 : 1), nullptr, &stream);
+  if(id < 0) {
+    fprintf(stderr, "WARN: Couldn't open HTTP/2 stream to %s: %s\n", host.c_str(), nghttp2_strerror(id));
+    stream.set_state(Connection::State::FAILED);
+    stream.close();
+    return;
+  }
+  stream.stream_id = id;
+  stream.stream_window = INITIAL_STREAM_WINDOW;
+  if(!receiving) {
+    flush();
+  }
+}
+
+void Http2Session::detach(Connection &stream) {
+  if(stream.stream_id > 0 && session != nullptr) {
+    nghttp2_session_set_stream_user_data(session, stream.stream_id, nullptr);
+    nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream.stream_id, NGHTTP2_CANCEL);
+  }
+  stream.stream_id = 0;
+  stream.session = nullptr;
+  streams.erase(std::remove(streams.begin(), streams.end(), &stream), streams.end());
+
+  // Streams are the scheduler's unit of parallelism, so one that's reset,
+  // cancelled or timed out is replaced while the session lives. Failures
+  // only up to a session's worth, so a mirror that fails every stream
+  // still runs out of them.
+  if(!closing && !client.finished && !stream.mirror->failed &&
+     (stream.state != Connection::State::FAILED || ++failed_streams <= client.streams_per_session)) {
+    auto &replacement = client.create_connection(*stream.mirror, host, path, "");
+    add_stream(replacement);
+    if(session == nullptr) {
+      // Joins the others in sending HEAD once connected
+      replacement.set_timeout(client.connect_timeout);
+    } else {
+      replacement.connect_rtt = rtt;
+      replacement.set_state(Connection::State::HEAD);
+      replacement.set_timeout(client.header_timeout);
+      replacement.send_head();
+    }
+  }
+
+  if(streams.empty()) {
+    closing = true;
+  }
+  if(!receiving) {
+    if(closing) {
+      shutdown();
+    } else {
+      flush();
+    }
+  }
+}
+
+void Http2Session::tune_window(Connection &stream) {
+  auto dt = uv_now(client.loop) - stream.stats.start_time;
+  if(dt < 100) {
+    return;
+  }
+
+  uint64_t rate = stream.stats.bytes * 1000 / dt;
+  uint64_t window = 2 * rate * std::max<uint64_t>(rtt, 1) / 1000;
+  window = std::max<uint64_t>(MIN_STREAM_WINDOW, std::min<uint64_t>(MAX_STREAM_WINDOW, window));
+  // Only bother the peer with changes of more than a quarter
+  if(window * 4 > stream.stream_window * 5 || window * 5 < stream.stream_window * 4) {
+    nghttp2_session_set_local_window_size(session, NGHTTP2_FLAG_NONE, stream.stream_id, window);
+    stream.stream_window = window;
+  }
+}
+
+void Http2Session::flush() {
+  if(session == nullptr || uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+
+  // One write at a time, so its request and buffer can be reused; nghttp2
+  // holds anything newer until it completes
+  if(writing) {
+    return;
+  }
+  write_buffer.clear();
+  const uint8_t *data;
+  ssize_t len;
+  while((len = nghttp2_session_mem_send(session, &data)) > 0) {
+    write_buffer.insert(write_buffer.end(), data, data + len);
+  }
+  if(len < 0) {
+    fail("protocol", nghttp2_strerror(len));
+    return;
+  }
+  if(write_buffer.empty()) {
+    return;
+  }
+
+  uv_buf_t buf = uv_buf_init(write_buffer.data(), write_buffer.size());
+  if(uv_write(&write_req, reinterpret_cast<uv_stream_t *>(&handle), &buf, 1, session_write_cb) == 0) {
+    writing = true;
+  }
+}
+
+void Http2Session::fail(const char *what, const char *why) {
+  if(closing) {
+    return;
+  }
+  fprintf(stderr, "WARN: HTTP/2 %s with %s failed: %s\n", what, host.c_str(), why);
+  closing = true;
+  auto victims = streams;
+  for(auto stream : victims) {
+    stream->set_state(Connection::State::FAILED);
+    stream->close();
+  }
+  if(!receiving) {
+    shutdown();
+  }
+}
+
+void Http2Session::watch() {
+  // Streams share the socket, so a session pauses as a whole
+  if(session == nullptr || uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+  if(client.reading) {
+    uv_read_start(reinterpret_cast<uv_stream_t *>(&handle), session_alloc_cb, session_read_cb);
+  } else {
+    uv_read_stop(reinterpret_cast<uv_stream_t *>(&handle));
+  }
+}
+
+void Http2Session::shutdown() {
+  if(uv_is_closing(reinterpret_cast<uv_handle_t *>(&handle))) {
+    return;
+  }
+  uv_close(reinterpret_cast<uv_handle_t *>(&handle), session_close_cb);
+}
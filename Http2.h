@@ -0,0 +1,66 @@
+#ifndef ANCHOR_HTTP2_H_
+#define ANCHOR_HTTP2_H_
+
+#include <string>
+#include <vector>
+#include <cinttypes>
+
+#include <arpa/inet.h>
+
+#include <uv.h>
+#include <nghttp2/nghttp2.h>
+
+struct Client;
+struct Connection;
+
+// A single TCP connection speaking prior-knowledge HTTP/2 (h2c), carrying
+// one Connection per concurrent stream. Streams are scheduled exactly like
+// HTTP/1.1 connections; only their I/O is routed through the session.
+struct Http2Session {
+  Http2Session(Client &c, std::string h, std::string p) : client(c), host(std::move(h)), path(std::move(p)) {
+    handle.data = this;
+    connect_req.data = this;
+    write_req.data = this;
+  }
+  ~Http2Session();
+
+  void connect(in_addr ip, in_port_t port);
+  void connect(in6_addr ip, in_port_t port);
+  void add_stream(Connection &stream);
+  void submit(Connection &stream, bool head, size_t off, size_t len);
+  // Called as a stream closes; cancels it if it's still open
+  void detach(Connection &stream);
+  // Sizes a stream's receive window to twice its bandwidth-delay product
+  void tune_window(Connection &stream);
+  void flush();
+  void fail(const char *what, const char *why);
+  // Starts or stops reading the socket to match Client::reading
+  void watch();
+  void shutdown();
+
+  uv_tcp_t handle;
+  uv_connect_t connect_req;
+  // The one write in flight, and its buffer, kept for the next
+  uv_write_t write_req;
+  std::vector<char> write_buffer;
+  bool writing = false;
+  nghttp2_session *session = nullptr;
+  Client &client;
+  const std::string host;
+  const std::string path;
+  std::vector<Connection *> streams;
+  std::vector<char> read_buffer;
+  uint64_t connect_start = 0;
+  uint64_t rtt = 0;
+  // Set while inside nghttp2_session_mem_recv, where teardown must wait
+  bool receiving = false;
+  bool work_ready = false;
+  bool closing = false;
+  // Failed streams replaced so far
+  unsigned failed_streams = 0;
+
+private:
+  void start_connect(const sockaddr *addr);
+};
+
+#endif
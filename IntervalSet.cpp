@@ -0,0 +1,85 @@
+#include "IntervalSet.h"
+
+#include <algorithm>
+#include <iterator>
+
+void IntervalSet::insert(Chunk chunk) {
+  if(chunk.len == 0)
+    return;
+
+  const size_t off = chunk.off, end = chunk.off + chunk.len;
+  auto it = intervals_.upper_bound(off);
+  if(it != intervals_.begin() && std::prev(it)->second >= off) {
+    // Overlaps or abuts its predecessor; grow that in place
+    --it;
+    if(it->second >= end)
+      return;
+    bytes_ += end - it->second;
+    it->second = end;
+  } else {
+    it = intervals_.emplace_hint(it, off, end);
+    bytes_ += end - off;
+  }
+
+  // Absorb any successors we now reach
+  auto next = std::next(it);
+  while(next != intervals_.end() && next->first <= it->second) {
+    bytes_ -= std::min(next->second, it->second) - next->first;
+    it->second = std::max(it->second, next->second);
+    next = intervals_.erase(next);
+  }
+}
+
+void IntervalSet::erase(Chunk chunk) {
+  if(chunk.len == 0)
+    return;
+
+  const size_t off = chunk.off, end = chunk.off + chunk.len;
+  auto it = intervals_.upper_bound(off);
+  if(it != intervals_.begin()) {
+    auto prev = std::prev(it);
+    if(prev->second > off) {
+      const size_t prev_end = prev->second;
+      if(prev->first == off) {
+        intervals_.erase(prev);
+      } else {
+        prev->second = off;
+      }
+      bytes_ -= prev_end - off;
+      if(prev_end > end) {
+        // Split: the tail survives
+        intervals_.emplace_hint(it, end, prev_end);
+        bytes_ += prev_end - end;
+        return;
+      }
+    }
+  }
+
+  while(it != intervals_.end() && it->first < end) {
+    if(it->second > end) {
+      const size_t tail_end = it->second;
+      bytes_ -= end - it->first;
+      it = intervals_.erase(it);
+      intervals_.emplace_hint(it, end, tail_end);
+      return;
+    }
+    bytes_ -= it->second - it->first;
+    it = intervals_.erase(it);
+  }
+}
+
+Chunk IntervalSet::find(size_t off) const {
+  auto it = intervals_.upper_bound(off);
+  if(it != intervals_.begin()) {
+    --it;
+    if(it->second > off)
+      return Chunk{it->first, it->second - it->first};
+  }
+  return Chunk{off, 0};
+}
+
+Chunk IntervalSet::first() const {
+  if(intervals_.empty())
+    return Chunk{0, 0};
+  return Chunk{intervals_.begin()->first, intervals_.begin()->second - intervals_.begin()->first};
+}
@@ -0,0 +1,91 @@
+#ifndef ANCHOR_INTERVALSET_H_
+#define ANCHOR_INTERVALSET_H_
+
+#include <map>
+#include <functional>
+#include <cstddef>
+#include <cinttypes>
+
+struct Chunk {
+  size_t off, len;
+};
+
+// Recycles map nodes through a per-thread free list, so that steady-state
+// splitting and merging of ranges doesn't touch the heap. The list goes
+// back to the heap when its thread exits, as download threads do.
+template<typename T>
+struct NodeAllocator {
+  typedef T value_type;
+
+  NodeAllocator() {}
+  template<typename U> NodeAllocator(const NodeAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    if(n == 1 && free_list.head != nullptr) {
+      void *node = free_list.head;
+      free_list.head = *static_cast<void **>(node);
+      return static_cast<T *>(node);
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    if(n == 1) {
+      *reinterpret_cast<void **>(p) = free_list.head;
+      free_list.head = p;
+      return;
+    }
+    ::operator delete(p);
+  }
+
+  struct FreeList {
+    ~FreeList() {
+      while(head != nullptr) {
+        void *next = *static_cast<void **>(head);
+        ::operator delete(head);
+        head = next;
+      }
+    }
+    void *head = nullptr;
+  };
+  static thread_local FreeList free_list;
+};
+
+template<typename T> thread_local typename NodeAllocator<T>::FreeList NodeAllocator<T>::free_list;
+
+template<typename T, typename U>
+bool operator==(const NodeAllocator<T> &, const NodeAllocator<U> &) { return true; }
+template<typename T, typename U>
+bool operator!=(const NodeAllocator<T> &, const NodeAllocator<U> &) { return false; }
+
+// Disjoint byte ranges, kept merged. Insertion, removal and lookup are
+// O(log n) in the number of disjoint ranges; extending a range at its end
+// (the common case while receiving) doesn't allocate.
+class IntervalSet {
+public:
+  typedef std::map<size_t, size_t, std::less<size_t>,
+                   NodeAllocator<std::pair<const size_t, size_t>>> Map;
+  typedef Map::const_iterator const_iterator;
+
+  void insert(Chunk chunk);
+  void erase(Chunk chunk);
+
+  // The range containing off, or an empty chunk at off if there is none
+  Chunk find(size_t off) const;
+  Chunk first() const;
+
+  bool empty() const { return intervals_.empty(); }
+  size_t count() const { return intervals_.size(); }
+  uint64_t size() const { return bytes_; }
+  void clear() { intervals_.clear(); bytes_ = 0; }
+
+  // Iterates (offset, end) pairs in ascending order
+  const_iterator begin() const { return intervals_.begin(); }
+  const_iterator end() const { return intervals_.end(); }
+
+private:
+  Map intervals_;
+  uint64_t bytes_ = 0;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include "Metrics.h"
+
+uint64_t Histogram::upper_bound(size_t index) {
+  if(index < SUB_BUCKETS) {
+    return index;
+  }
+  unsigned shift = (index >> SUB_BITS) - 1;
+  uint64_t base = (SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+  return base + ((1ULL << shift) - 1);
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+  uint64_t rank = fraction * count_;
+  uint64_t seen = 0;
+  for(size_t i = 0; i < BUCKETS; ++i) {
+    seen += counts_[i];
+    if(seen > rank) {
+      // The top bucket's bound can overshoot what was actually seen
+      uint64_t bound = upper_bound(i);
+      return bound < max_ ? bound : max_;
+    }
+  }
+  return max_;
+}
+
+void Histogram::print(FILE *out, const char *name, const char *unit) const {
+  if(count_ == 0) {
+    fprintf(out, "%-14s no samples\n", name);
+    return;
+  }
+  fprintf(out, "%-14s n=%" PRIu64 " mean=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64 " p99.9=%" PRIu64
+          " max=%" PRIu64 " %s\n", name, count_, sum_ / count_, percentile(0.5), percentile(0.9), percentile(0.99),
+          percentile(0.999), max_, unit);
+}
+
+void Metrics::print(FILE *out) const {
+  read_bytes.print(out, "read size", "B");
+  loop_us.print(out, "loop interval", "us");
+  parse_ns.print(out, "parse", "ns");
+  body_ns.print(out, "body", "ns");
+  schedule_ns.print(out, "schedule", "ns");
+  direct_faults.print(out, "direct faults", "faults/read");
+  copied_bytes.print(out, "copied", "B/response");
+}
@@ -0,0 +1,80 @@
+#ifndef ANCHOR_METRICS_H_
+#define ANCHOR_METRICS_H_
+
+#include <cstdio>
+#include <cinttypes>
+
+#include <uv.h>
+
+// Log-linear histogram after HdrHistogram: every power of two is split into
+// eight linear buckets, so any uint64 value is kept to within 12.5% in a
+// fixed 4 KiB of counters. Recording never allocates.
+class Histogram {
+public:
+  void record(uint64_t value) {
+    ++counts_[bucket(value)];
+    ++count_;
+    sum_ += value;
+    if(value > max_) {
+      max_ = value;
+    }
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  // Upper bound of the bucket holding the given fraction of values
+  uint64_t percentile(double fraction) const;
+  void print(FILE *out, const char *name, const char *unit) const;
+
+private:
+  static const unsigned SUB_BITS = 3;
+  static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+  static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+  static size_t bucket(uint64_t value) {
+    if(value < SUB_BUCKETS) {
+      return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    return ((msb - SUB_BITS + 1) << SUB_BITS) + ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+  }
+  static uint64_t upper_bound(size_t index);
+
+  uint64_t counts_[BUCKETS] = {};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+// Receive-path and event loop instrumentation, cheap enough to stay on
+struct Metrics {
+  // Bytes per read(2) or splice(2); TLS reads count ciphertext
+  Histogram read_bytes;
+  // Between successive loop iterations, waiting included
+  Histogram loop_us;
+  // In http_parser_execute, callbacks included
+  Histogram parse_ns;
+  Histogram body_ns;
+  Histogram schedule_ns;
+  // Minor faults taken by one in every FAULT_SAMPLE reads into the mapping
+  static const unsigned FAULT_SAMPLE = 16;
+  Histogram direct_faults;
+  // Body bytes per response copied from a connection's buffer rather than
+  // received in place
+  Histogram copied_bytes;
+
+  void print(FILE *out) const;
+};
+
+// Records the lifetime of the scope in nanoseconds
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram &histogram) : histogram_(histogram), start_(uv_hrtime()) {}
+  ~ScopedTimer() { histogram_.record(uv_hrtime() - start_); }
+
+private:
+  Histogram &histogram_;
+  const uint64_t start_;
+};
+
+#endif
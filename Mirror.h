@@ -0,0 +1,45 @@
+#ifndef ANCHOR_MIRROR_H_
+#define ANCHOR_MIRROR_H_
+
+#include <string>
+#include <cinttypes>
+
+#include <arpa/inet.h>
+
+struct Client;
+
+// One source URL, from DNS resolution through probing and selection
+struct Mirror {
+  Mirror(std::string rh, std::string h, in_port_t p, std::string pa, bool t, Client &c)
+      : req_host(std::move(rh)), host(std::move(h)), port(p), path(std::move(pa)), tls(t), client(c) {}
+
+  // Ranking key; lower is better
+  uint64_t score() const { return connect_rtt + ttfb; }
+
+  const std::string req_host;
+  const std::string host;
+  const in_port_t port;
+  const std::string path;
+  const bool tls;
+  Client &client;
+
+  // Milliseconds, measured by the first HEAD to complete
+  bool probed = false;
+  uint64_t connect_rtt = 0;
+  uint64_t ttfb = 0;
+
+  // Address from the first lookup, reused for added connections
+  int family = 0;
+  in_addr ip4;
+  in6_addr ip6;
+
+  // Open connections; a mirror that drops to none has failed
+  unsigned connections = 0;
+  bool failed = false;
+  // Held back until an active mirror fails
+  bool standby = false;
+  // Cleared once it refuses ranges or answers one with the whole file
+  bool ranges = true;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "Tls.h"
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "Client.h"
+#include "Connection.h"
+
+Tls::~Tls() {
+  for(auto &host : hosts_) {
+    if(host.second.session != nullptr) {
+      SSL_SESSION_free(host.second.session);
+    }
+  }
+  if(ctx_ != nullptr) {
+    SSL_CTX_free(ctx_);
+  }
+}
+
+const char *Tls::start(const char *ca_file) {
+  ctx_ = SSL_CTX_new(TLS_client_method());
+  if(ctx_ == nullptr) {
+    return ERR_reason_error_string(ERR_get_error());
+  }
+  SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+  SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+  if(1 != SSL_CTX_set_default_verify_paths(ctx_)) {
+    return ERR_reason_error_string(ERR_get_error());
+  }
+  if(ca_file != nullptr && 1 != SSL_CTX_load_verify_locations(ctx_, ca_file, nullptr)) {
+    return ERR_reason_error_string(ERR_get_error());
+  }
+
+  // We keep sessions ourselves, keyed by host rather than by SSL_CTX
+  SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx_, new_session_cb);
+  return nullptr;
+}
+
+SSL *Tls::create(Connection &connection) {
+  SSL *ssl = SSL_new(ctx_);
+  SSL_set_app_data(ssl, &connection);
+  SSL_set_connect_state(ssl);
+
+  const char *name = connection.server_name.c_str();
+  unsigned char addr[sizeof(in6_addr)];
+  if(1 == inet_pton(AF_INET, name, addr) || 1 == inet_pton(AF_INET6, name, addr)) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name);
+  } else {
+    SSL_set_tlsext_host_name(ssl, name);
+    SSL_set1_host(ssl, name);
+  }
+
+  auto &host = hosts_[connection.host];
+  if(host.session != nullptr) {
+    SSL_set_session(ssl, host.session);
+  }
+  return ssl;
+}
+
+bool Tls::park(Connection &connection) {
+  auto &host = hosts_[connection.host];
+  if(host.session != nullptr) {
+    return false;
+  }
+  if(host.leader == nullptr) {
+    host.leader = &connection;
+    return false;
+  }
+  host.waiters.push_back(&connection);
+  return true;
+}
+
+void Tls::unpark(Connection &connection) {
+  auto &waiters = hosts_[connection.host].waiters;
+  waiters.erase(std::remove(waiters.begin(), waiters.end(), &connection), waiters.end());
+}
+
+void Tls::release(Connection &connection) {
+  auto &host = hosts_[connection.host];
+  if(host.leader != &connection) {
+    return;
+  }
+  host.leader = nullptr;
+
+  // Without a session, the first waiter leads the next attempt
+  std::vector<Connection *> waiters;
+  waiters.swap(host.waiters);
+  for(auto waiter : waiters) {
+    waiter->tls_parked = park(*waiter);
+    if(!waiter->tls_parked) {
+      waiter->start_tls();
+    }
+  }
+}
+
+int Tls::new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  auto &connection = *static_cast<Connection *>(SSL_get_app_data(ssl));
+  auto &tls = connection.client.tls;
+  auto &host = tls.hosts_[connection.host];
+  if(host.session != nullptr) {
+    SSL_SESSION_free(host.session);
+  }
+  host.session = session;
+  tls.release(connection);
+  // We took ownership of the session
+  return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef ANCHOR_TLS_H_
+#define ANCHOR_TLS_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <openssl/ssl.h>
+
+struct Connection;
+
+// Client-side TLS context shared by every connection. Sessions are cached
+// per host, and connections opened while the first full handshake to a host
+// is still underway wait for its session instead of all doing full
+// handshakes at once.
+class Tls {
+public:
+  ~Tls();
+
+  // Returns nullptr on success, or a description of the failure
+  const char *start(const char *ca_file);
+
+  SSL *create(Connection &connection);
+
+  // True if the connection must wait for another handshake to its host
+  bool park(Connection &connection);
+  void unpark(Connection &connection);
+  // Called by a host's leading connection once waiters can proceed
+  void release(Connection &connection);
+
+private:
+  struct Host {
+    SSL_SESSION *session = nullptr;
+    Connection *leader = nullptr;
+    std::vector<Connection *> waiters;
+  };
+
+  static int new_session_cb(SSL *ssl, SSL_SESSION *session);
+
+  SSL_CTX *ctx_ = nullptr;
+  std::unordered_map<std::string, Host> hosts_;
+};
+
+#endif
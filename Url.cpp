@@ -1,5 +1,7 @@
 #include "Url.h"
 
+#include <strings.h>
+
 #define PARSE_NOSKIP(elt)                       \
   elt.base = token_start;                       \
   elt.len = cursor - token_start;               \
@@ -99,3 +101,16 @@ Url::Url(const char *begin, const char *end) {
     }
   }
 }
+
+Url::Transport Url::transport() const {
+  if(scheme.base == nullptr) {
+    return Transport::HTTP;
+  }
+  if(scheme.len == 4 && 0 == strncasecmp(scheme.base, "http", 4)) {
+    return Transport::HTTP;
+  }
+  if(scheme.len == 5 && 0 == strncasecmp(scheme.base, "https", 5)) {
+    return Transport::HTTPS;
+  }
+  return Transport::UNSUPPORTED;
+}
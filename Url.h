@@ -4,6 +4,8 @@
 #include <cstddef>
 #include <cstring>
 
+#include <netinet/in.h>
+
 struct Url {
   Url(const char *begin, const char *end);
   Url(const char *c_str) : Url(c_str, c_str + strlen(c_str)) {}
@@ -14,6 +16,11 @@ struct Url {
   };
 
   Component scheme, userinfo, host, port, path, query, fragment;
+
+  // How to fetch this URL; a missing scheme means plain HTTP
+  enum class Transport { HTTP, HTTPS, UNSUPPORTED };
+  Transport transport() const;
+  in_port_t default_port() const { return transport() == Transport::HTTPS ? 443 : 80; }
 };
 
 #endif
@@ -1,6 +1,22 @@
 #ifndef ANCHOR_UTIL_H_
 #define ANCHOR_UTIL_H_
 
+#include <cinttypes>
+
 #define elementsof(array) (sizeof(array) / sizeof((array)[0]))
 
+// Writes value in decimal without a terminator, returning the new end
+inline char *format_decimal(char *out, uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while(value != 0);
+  while(n != 0) {
+    *out++ = digits[--n];
+  }
+  return out;
+}
+
 #endif
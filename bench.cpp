@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include "Connection.h"
+#include "Client.h"
+
+// Downloads a file from a fake server at the other end of a socketpair, so
+// the whole per-chunk path runs for real: take_chunk, the GET request,
+// reading and parsing the 206 response and its headers, receiving the body
+// in place, and completion. Every trip to the heap is counted once the
+// first WARMUP chunks have warmed up the connection and interval sets, until
+// the last byte arrives; the run fails if that allocates at all, or if any
+// body byte was copied out of a connection's buffer rather than received in
+// place. Every SPLIT_EVERY'th response sends the last byte of its headers
+// separately, so the blank line ending them straddles two reads.
+
+namespace {
+size_t allocations = 0;
+
+const uint64_t FILE_SIZE = 256 * 1024 * 1024;
+const uint64_t CHUNK_SIZE = 256 * 1024;
+const size_t WARMUP = 16;
+const size_t SPLIT_EVERY = 8;
+
+// The server's side: answers each GET as it arrives, headers and body
+// written together, as a server would send them, unless split
+struct Server {
+  int fd;
+  const uint8_t *file;
+  char request[4096];
+  size_t request_len = 0;
+  char headers[512];
+  // Headers, then their final byte if split, then the body
+  struct iovec out[3];
+  bool split = false;
+  size_t responses = 0;
+
+  Server(int fd, const uint8_t *file) : fd(fd), file(file), out() {}
+
+  // Reads whatever has arrived; true once a whole request has, and its
+  // response is queued in out
+  bool receive() {
+    ssize_t n = read(fd, request + request_len, sizeof(request) - request_len - 1);
+    if(n <= 0) {
+      return false;
+    }
+    request_len += n;
+    request[request_len] = '\0';
+    char *end = strstr(request, "\r\n\r\n");
+    if(end == nullptr) {
+      return false;
+    }
+
+    uint64_t first, last;
+    const char *range = strstr(request, "Range: bytes=");
+    if(range == nullptr || sscanf(range, "Range: bytes=%" SCNu64 "-%" SCNu64, &first, &last) != 2) {
+      fprintf(stderr, "bench: unexpected request\n");
+      exit(2);
+    }
+    int len = snprintf(headers, sizeof(headers),
+                       "HTTP/1.1 206 Partial Content\r\n"
+                       "Server: bench\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Accept-Ranges: bytes\r\n"
+                       "ETag: \"bench\"\r\n"
+                       "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n"
+                       "Content-Length: %" PRIu64 "\r\n"
+                       "\r\n", first, last, FILE_SIZE, last - first + 1);
+    split = responses % SPLIT_EVERY == 0;
+    out[0].iov_base = headers;
+    out[0].iov_len = split ? len - 1 : len;
+    out[1].iov_base = headers + out[0].iov_len;
+    out[1].iov_len = len - out[0].iov_len;
+    out[2].iov_base = const_cast<uint8_t *>(file + first);
+    out[2].iov_len = last - first + 1;
+
+    size_t used = end + 4 - request;
+    memmove(request, request + used, request_len - used);
+    request_len -= used;
+    ++responses;
+    return true;
+  }
+
+  bool sending() const { return out[0].iov_len + out[1].iov_len + out[2].iov_len != 0; }
+
+  // A split response's first write stops short, leaving the client a
+  // chance to read it before the rest follows
+  void send() {
+    size_t first = 0;
+    while(out[first].iov_len == 0) {
+      ++first;
+    }
+    ssize_t n = writev(fd, out + first, split && first == 0 ? 1 : 3 - first);
+    if(n < 0) {
+      if(errno != EAGAIN) {
+        perror("bench: writev");
+        exit(2);
+      }
+      return;
+    }
+    for(auto &part : out) {
+      size_t done = std::min<size_t>(n, part.iov_len);
+      part.iov_base = static_cast<uint8_t *>(part.iov_base) + done;
+      part.iov_len -= done;
+      n -= done;
+    }
+  }
+};
+}
+
+void *operator new(size_t size) {
+  ++allocations;
+  if(void *p = malloc(size != 0 ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+int main() {
+  std::vector<uint8_t> file(FILE_SIZE), output(FILE_SIZE);
+  for(size_t i = 0; i < file.size(); ++i) {
+    file[i] = i * 31 + 7;
+  }
+
+  int sockets[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+    perror("socketpair");
+    return 2;
+  }
+  fcntl(sockets[1], F_SETFL, O_NONBLOCK);
+  Server server(sockets[1], file.data());
+
+  Client client;
+  client.file_size = FILE_SIZE;
+  client.file_data = output.data();
+  client.output_ready = true;
+  client.window_size = CHUNK_SIZE;
+  // Counting stops with the last byte, before the download's teardown
+  size_t after = 0;
+  client.on_progress = [&after](Client &c) {
+    if(c.stats.bytes == FILE_SIZE) {
+      after = allocations;
+    }
+  };
+  bool done = false;
+  client.on_done = [&done](Client &, const char *error) {
+    if(error != nullptr) {
+      fprintf(stderr, "bench: %s\n", error);
+      exit(2);
+    }
+    done = true;
+  };
+
+  client.mirrors.emplace_back("bench", "bench", 80, "/file", false, client);
+  auto &conn = client.create_connection(client.mirrors.back(), "bench", "/file", "");
+  uv_tcp_open(&conn.handle, sockets[0]);
+  conn.request_template = " /file HTTP/1.1\r\nHost: bench\r\nUser-Agent: bench\r\nConnection: keep-alive\r\n";
+  conn.receiving = true;
+  conn.watch();
+  conn.set_state(Connection::State::IDLE);
+  client.pending.insert(Chunk{0, FILE_SIZE});
+
+  size_t before = 0;
+  uint64_t copied_before = 0;
+  uint64_t start = 0;
+  client.schedule_work();
+  while(!done) {
+    if(!server.sending() && server.receive() && server.responses == WARMUP + 1) {
+      before = allocations;
+      copied_before = client.metrics.copied_bytes.sum();
+      start = uv_hrtime();
+    }
+    if(server.sending()) {
+      server.send();
+    }
+    uv_run(client.loop, UV_RUN_NOWAIT);
+  }
+  uint64_t elapsed = uv_hrtime() - start;
+  size_t allocated = after - before;
+  uint64_t copied = client.metrics.copied_bytes.sum() - copied_before;
+  size_t chunks = server.responses - WARMUP;
+
+  if(output != file) {
+    fprintf(stderr, "bench: output doesn't match\n");
+    return 2;
+  }
+  printf("%zu chunks, %.1f us per chunk, %zu allocations (%.2f per chunk), %" PRIu64 " body bytes copied\n",
+         chunks, elapsed / 1000.0 / chunks, allocated, static_cast<double>(allocated) / chunks, copied);
+  close(sockets[1]);
+  return allocated == 0 && copied == 0 ? 0 : 1;
+}
@@ -1,10 +1,11 @@
 #include <string>
-#include <algorithm>
 
 #include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <cstdlib>
+#include <cmath>
+#include <csignal>
 
 #include <uv.h>
 
@@ -20,14 +21,110 @@
 
 enum OptionId {
   OUTPUT,
-  USER_AGENT
+  USER_AGENT,
+  CONNECT_TIMEOUT,
+  HEADER_TIMEOUT,
+  IDLE_TIMEOUT,
+  CA_FILE,
+  HTTP2,
+  STREAMS,
+  WINDOW,
+  POPULATE,
+  SPLICE,
+  NO_AUTOTUNE,
+  MIRRORS,
+  SEED,
+  BLOCK_MAP,
+  CACHE,
+  CACHE_SIZE,
+  AUTOSCALE,
+  STATS,
+  CONTROL,
+  RATE,
+  CHECKSUM
 };
 
 const std::vector<Option::Specifier> options({
     {OUTPUT, "output", 'o', "path", Option::Type::STRING, "file to write"},
     {USER_AGENT, "user-agent", 'u', "user agent", Option::Type::STRING, "user-agent to transmit to the server"},
+    {CONNECT_TIMEOUT, "connect-timeout", 'c', "seconds", Option::Type::UNSIGNED_INTEGER, "give up on a connection attempt after this long (0 to disable)"},
+    {HEADER_TIMEOUT, "header-timeout", 'h', "seconds", Option::Type::UNSIGNED_INTEGER, "give up on a request whose response headers take this long (0 to disable)"},
+    {IDLE_TIMEOUT, "idle-timeout", 'i', "seconds", Option::Type::UNSIGNED_INTEGER, "give up on a response that stalls for this long (0 to disable)"},
+    {CA_FILE, "ca-file", 'C', "path", Option::Type::STRING, "additional trusted certificates for https, in PEM format"},
+    {HTTP2, "http2", '2', "speak HTTP/2 to http:// servers without negotiating"},
+    {STREAMS, "streams", 'n', "count", Option::Type::UNSIGNED_INTEGER, "concurrent range requests per HTTP/2 connection"},
+    {WINDOW, "window", 'w', "MiB", Option::Type::UNSIGNED_INTEGER, "map at most this much of the output per connection instead of the whole file"},
+    {POPULATE, "populate", 'P', "prefault output ranges as they are claimed and request huge pages"},
+    {SPLICE, "splice", 's', "move http:// response bodies from socket to file with splice(2)"},
+    {NO_AUTOTUNE, "no-autotune", 'T', "leave socket buffer sizes to the kernel"},
+    {MIRRORS, "mirrors", 'm', "count", Option::Type::UNSIGNED_INTEGER, "probe every URL and download from only the fastest few, keeping the rest in reserve (0 for all)"},
+    {SEED, "seed", 'S', "path", Option::Type::STRING, "previous version of the file to take unchanged blocks from (needs --zsync)"},
+    {BLOCK_MAP, "zsync", 'z', "path", Option::Type::STRING, ".zsync control file describing the new version's blocks"},
+    {CACHE, "cache", 'k', "path", Option::Type::STRING, "directory of pieces kept from earlier downloads, reused when the server's validator matches"},
+    {CACHE_SIZE, "cache-size", 'K', "MiB", Option::Type::UNSIGNED_INTEGER, "evict the least recently used cache entries beyond this size"},
+    {AUTOSCALE, "autoscale", 'a', "count", Option::Type::UNSIGNED_INTEGER, "open up to this many connections per mirror while throughput keeps improving"},
+    {STATS, "stats", 'I', "print receive-path and event loop histograms at exit, as SIGUSR1 does at any time"},
+    {CONTROL, "control", 'X', "path", Option::Type::STRING, "accept commands adjusting the download on a Unix-domain socket (send \"help\" for a list)"},
+    {RATE, "rate", 'r', "KiB/s", Option::Type::UNSIGNED_INTEGER, "limit the receive rate (0 for no limit)"},
+    {CHECKSUM, "checksum", 'H', "algo:hex", Option::Type::STRING, "verify the file against a digest hashed as it arrives, by any OpenSSL digest name; tree-<name> hashes 1 MiB leaves on every core and pairs them up to a root, as computed by the script in README.md"},
   });
 
+void print_bytes(uint64_t bytes) {
+  uint8_t exponent = log(bytes) / log(1024);
+  if(exponent == 0) {
+    printf("%" PRIu64 "B", bytes);
+    return;
+  }
+  const static char abbrevs[] = "KMGTPE";
+  if(exponent - 1 >= elementsof(abbrevs)) {
+    printf("%.1fEiB", bytes / pow(1024, 6));
+    return;
+  }
+  char abbrev = abbrevs[exponent - 1];
+  printf("%.1f%ciB", bytes / pow(1024, exponent), abbrev);
+}
+
+void print_progress(Client &client) {
+  auto now = uv_now(client.loop);
+
+  // cursor horizontal absolute 0 - erase in line - print
+  printf("\x1B[0G" "\x1B[K");
+  if(client.file_size != ~0ULL) {
+    printf("%.1f%%", 100.f * (double)client.stats.bytes / (double)client.file_size);
+  } else {
+    // Streaming a file of unknown size
+    print_bytes(client.stats.bytes);
+  }
+
+  {
+    uint64_t dt = now - client.stats.start_time;
+    printf(" - %" PRIu64 "s", dt / 1000);
+    if(dt != 0) {
+      printf(" - ");
+      print_bytes(client.stats.bytes / dt * 1000);
+      printf("/s = ");
+    }
+  }
+
+  bool first = true;
+  for(auto state : {Connection::State::GET_COPY, Connection::State::GET_DIRECT, Connection::State::GET_STREAM}) {
+    for(auto conn : client.in_state(state)) {
+      auto dt = now - conn->stats.start_time;
+      if(dt != 0) {
+        if(!first) {
+          printf(" + ");
+        } else {
+          first = false;
+        }
+        print_bytes(conn->stats.bytes / dt * 1000);
+        printf("/s");
+      }
+    }
+  }
+
+  fflush(stdout);
+}
+
 void usage(const char *name) {
   fprintf(stderr, "Usage: %s [options] <url>*\nOptions:\n", name);
   print_options(options);
@@ -39,9 +136,24 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  std::vector<Url> urls;
+  std::vector<const char *> urls;
   urls.reserve(argc-1);
   const char *path = nullptr, *user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0";
+  const char *ca_file = nullptr;
+  const char *seed = nullptr, *block_map = nullptr;
+  const char *cache = nullptr;
+  uint64_t cache_size = 1024;
+  unsigned autoscale = 0;
+  bool stats = false;
+  const char *control = nullptr;
+  uint64_t rate = 0;
+  const char *checksum = nullptr;
+  uint64_t connect_timeout = 10, header_timeout = 30, idle_timeout = 30;
+  bool http2 = false;
+  unsigned streams = 8;
+  uint64_t window = 0;
+  unsigned mirrors = 0;
+  bool populate = false, splice = false, autotune = true;
   for(const auto &param : parse_options(argc, argv, options)) {
     switch(param.id) {
     case OUTPUT:
@@ -52,9 +164,89 @@ int main(int argc, char **argv) {
       user_agent = param.parameter.string;
       break;
 
+    case CONNECT_TIMEOUT:
+      connect_timeout = param.parameter.unsigned_integer;
+      break;
+
+    case HEADER_TIMEOUT:
+      header_timeout = param.parameter.unsigned_integer;
+      break;
+
+    case IDLE_TIMEOUT:
+      idle_timeout = param.parameter.unsigned_integer;
+      break;
+
+    case CA_FILE:
+      ca_file = param.parameter.string;
+      break;
+
+    case HTTP2:
+      http2 = true;
+      break;
+
+    case STREAMS:
+      streams = param.parameter.unsigned_integer;
+      break;
+
+    case WINDOW:
+      window = param.parameter.unsigned_integer;
+      break;
+
+    case POPULATE:
+      populate = true;
+      break;
+
+    case SPLICE:
+      splice = true;
+      break;
+
+    case NO_AUTOTUNE:
+      autotune = false;
+      break;
+
+    case MIRRORS:
+      mirrors = param.parameter.unsigned_integer;
+      break;
+
+    case SEED:
+      seed = param.parameter.string;
+      break;
+
+    case BLOCK_MAP:
+      block_map = param.parameter.string;
+      break;
+
+    case CACHE:
+      cache = param.parameter.string;
+      break;
+
+    case CACHE_SIZE:
+      cache_size = param.parameter.unsigned_integer;
+      break;
+
+    case AUTOSCALE:
+      autoscale = param.parameter.unsigned_integer;
+      break;
+
+    case STATS:
+      stats = true;
+      break;
+
+    case CONTROL:
+      control = param.parameter.string;
+      break;
+
+    case RATE:
+      rate = param.parameter.unsigned_integer;
+      break;
+
+    case CHECKSUM:
+      checksum = param.parameter.string;
+      break;
+
     default: {
-      urls.emplace_back(param.parameter.string);
-      const auto &url = urls.back();
+      urls.push_back(param.parameter.string);
+      const Url url(param.parameter.string);
       if(path == nullptr && url.path.base != nullptr && url.path.len != 0) {
         path = url.path.base;
         for(const char *ch = url.path.base; ch != url.path.base + url.path.len - 1; ++ch) {
@@ -81,47 +273,65 @@ int main(int argc, char **argv) {
   Client client;
   client.file_name = path;
   client.user_agent = user_agent;
+  client.connect_timeout = connect_timeout * 1000;
+  client.header_timeout = header_timeout * 1000;
+  client.idle_timeout = idle_timeout * 1000;
+  client.http2 = http2;
+  client.streams_per_session = streams;
+  client.window_size = window * 1024 * 1024;
+  client.populate = populate;
+  client.splice = splice;
+  client.autotune_sockets = autotune;
+  client.mirror_limit = mirrors;
+  client.probing = mirrors != 0;
+  client.ca_file = ca_file;
+  client.seed_file = seed;
+  client.block_map_file = block_map;
+  client.cache_dir = cache;
+  client.cache_limit = cache_size * 1024 * 1024;
+  client.autoscale_max = autoscale;
+  client.control_path = control;
+  client.rate_limit = rate * 1024;
+  client.checksum_spec = checksum;
+  client.on_progress = print_progress;
+  const char *error = nullptr;
+  bool done = false;
+  uv_signal_t usr1;
+  client.on_done = [&](Client &, const char *err) {
+    done = true;
+    error = err;
+    uv_close(reinterpret_cast<uv_handle_t *>(&usr1), nullptr);
+  };
 
-  if(int err = client.ares.start()) {
-    fprintf(stderr, "FATAL: c-ares: %s\n", ares_strerror(err));
-    return 2;
-  }
-
-  if(int err = client.dns.start()) {
-    fprintf(stderr, "FATAL: c-ares: %s\n", ares_strerror(err));
-    return 3;
+  for(auto url : urls) {
+    client.add_url(url);
   }
 
-  for(const auto &url : urls) {
-    if(url.scheme.base != nullptr &&
-       url.scheme.len != 4 &&
-       0 != strncmp(url.scheme.base, "http", url.scheme.len)) {
-      fprintf(stderr, "WARN: Skipping url with non-http scheme %s\n", std::string(url.scheme.base, url.scheme.len).c_str());
-      continue;
-    }
-
-    if(url.host.base == nullptr || url.host.len == 0) {
-      fprintf(stderr, "WARN: Skipping URL with no host component\n(did you forget the leading \"//\"?)\n");
-      continue;
-    }
+  // Before start(), which calls on_done itself if it fails early
+  uv_signal_init(client.loop, &usr1);
+  usr1.data = &client;
+  uv_signal_start(&usr1, [](uv_signal_t *handle, int) {
+      fputs("\n", stderr);
+      reinterpret_cast<Client *>(handle->data)->metrics.print(stderr);
+    }, SIGUSR1);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&usr1));
 
-    const in_port_t port = url.port.base == nullptr ? 80 : strtol(url.port.base, nullptr, 10);
-    if(port == 0) {
-      fprintf(stderr, "WARN: Skipping URL with invalid port: %s\n", std::string(url.port.base, url.port.len).c_str());
-      continue;
-    }
-    std::string path = url.path.base != nullptr ? std::string(url.path.base, url.path.len) : "/";
-    client.open(std::string(url.host.base, url.host.len) + (url.port.base ? ":" + std::string(url.port.base, url.port.len) : ""),
-                std::string(url.host.base, url.host.len), port, std::move(path));
+  if(const char *err = client.start()) {
+    fprintf(stderr, "FATAL: %s\n", err);
+    // Lets handles created before the failure finish closing
+    uv_run(client.loop, UV_RUN_DEFAULT);
+    return 2;
   }
 
-  client.ares_stage();
+  uv_run(client.loop, UV_RUN_DEFAULT);
 
-  uv_run(&client.loop, UV_RUN_DEFAULT);
+  if(stats) {
+    fputs("\n", stderr);
+    client.metrics.print(stderr);
+  }
 
-  if(std::any_of(client.connections.begin(), client.connections.end(),
-                 [](const Connection &c) { return c.state != Connection::State::COMPLETE; })) {
-    fprintf(stderr, "Download failed!\n");
+  if(!done || error != nullptr) {
+    fprintf(stderr, "\nDownload failed: %s\n", error != nullptr ? error : "stopped early");
     return -1;
   }
 